@@ -5,87 +5,181 @@
 #include <fcntl.h>      /* open */
 #include <sys/types.h>  /* DIR */
 #include <sys/stat.h>   /* fstatat */
+#include <sys/mman.h>   /* mmap */
+#include <sys/inotify.h> /* inotify_init1 */
+#include <sys/socket.h> /* socket */
+#include <sys/un.h>     /* sockaddr_un */
+#include <poll.h>       /* poll */
+#include <termios.h>    /* tcsetattr */
+#include <sys/ioctl.h>  /* TIOCGWINSZ */
+#include <linux/fs.h>   /* FS_IOC_FIEMAP */
+#include <linux/fiemap.h> /* fiemap */
+#include <linux/io_uring.h> /* io_uring_sqe */
+#include <signal.h>     /* signal */
+#include <sys/resource.h> /* setpriority */
+#include <sys/syscall.h> /* SYS_ioprio_set */
+#include <pwd.h>        /* getpwuid */
+#include <grp.h>        /* getgrgid */
+#include <locale.h>     /* newlocale */
+#include <wctype.h>     /* towlower_l */
+#include <fnmatch.h>    /* fnmatch */
+#include <limits.h>     /* PATH_MAX */
 #include <unistd.h>     /* isatty */
 #include <unistd.h>     /* getopt */
+#include <getopt.h>     /* getopt_long */
 
 #include <cerrno>       /* errno */
 #include <cstring>      /* strerror */
-#include <stdexcept>    /* runtime_error */
 #include <string_view>  /* sv */
-#include <memory>       /* shared_ptr */
+#include <cstddef>      /* nullptr_t */
+#include <memory>       /* unique_ptr */
 #include <optional>     /* nullopt */
 #include <utility>      /* exchange */
 #include <iostream>
 #include <vector>
-#include <string>       /* string, stoi */
+#include <string>       /* string */
+#include <charconv>     /* from_chars */
 #include <iterator>
 #include <variant>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <algorithm>
+#include <bit>          /* bit_ceil */
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <queue>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <iomanip>
 
 using namespace std::literals;
 
-auto sys_errx(const char* str)
+inline bool OutputTerminal = false;
+
+enum class op_t : uint8_t
 {
-    return std::runtime_error(std::string(str));
-}
+    fstatat,
+    openat,
+    fdopendir,
+    readdir,
+    open,
+    fstat,
+    mmap,
+    write,
+    inotify,
+    socket,
+    poll,
+    rename,
+    statx,
+    uring,
+};
 
-std::string sys_err_str(const char* str)
+constexpr const char* op_name(op_t op)
 {
-    int err = errno;
-    return std::string(str) + ": ("
-         + std::to_string(err) + ") "
-         + std::strerror(err);
+    switch (op)
+    {
+        case op_t::fstatat:   return "fstatat";
+        case op_t::openat:    return "openat";
+        case op_t::fdopendir: return "fdopendir";
+        case op_t::readdir:   return "readdir";
+        case op_t::open:      return "open";
+        case op_t::fstat:     return "fstat";
+        case op_t::mmap:      return "mmap";
+        case op_t::write:     return "write";
+        case op_t::inotify:   return "inotify_init1";
+        case op_t::socket:    return "socket";
+        case op_t::poll:      return "poll";
+        case op_t::rename:    return "rename";
+        case op_t::statx:     return "statx";
+        case op_t::uring:     return "io_uring";
+    }
+    return "?";
 }
 
-inline bool OutputTerminal = false;
-
+// Errors are kept as plain values and only turned into text when printed,
+// a scan of a restricted volume can produce a lot of them.
 struct err_t
 {
-    std::string str;
+    int code = 0;
+    op_t op = {};
 
-    err_t(std::string&& str) : str(str) {}
+    static err_t last(op_t op) noexcept { return { errno, op }; }
+
+    std::string text() const
+    {
+        return std::string(op_name(op)) + ": (" + std::to_string(code)
+             + ") " + std::strerror(code);
+    }
+
+    std::ostream& message(std::ostream& o) const
+    {
+        return o << op_name(op) << ": ("
+                 << code << ") " << std::strerror(code);
+    }
 
     friend std::ostream& operator<<(std::ostream& o, const err_t& e)
     {
-        return o
-            << ( OutputTerminal ? "\e[1;31m" : "" )
-            << "(error: " << e.str << ")"
-            << ( OutputTerminal ? "\e[0m" : "" );
+        o << ( OutputTerminal ? "\e[1;31m" : "" ) << "(error: ";
+        e.message(o);
+        return o << ")" << ( OutputTerminal ? "\e[0m" : "" );
     }
 };
 
-struct fd_t
+// Intrusive, non-atomic reference count. The traversal is single-threaded,
+// so sharing a handle between an iterator and its entries is a plain
+// increment rather than the atomic traffic of std::shared_ptr.
+struct ref_counted
 {
-    int fd = -1;
+    unsigned refs = 0;
+};
 
-    fd_t(int fd_) : fd(fd_) {}
-    ~fd_t() { close(); }
+template<typename T>
+class ref_ptr
+{
+    T* p = nullptr;
 
-    fd_t(const fd_t&) = delete;
-    fd_t& operator=(const fd_t&) = delete;
+public:
+    ref_ptr() noexcept = default;
+    ref_ptr(std::nullptr_t) noexcept {}
 
-    fd_t(fd_t&& o) noexcept
-        : fd(std::exchange(o.fd, -1))
-    { }
+    explicit ref_ptr(T* p_) noexcept : p(p_) { if (p) ++p->refs; }
 
-    fd_t& operator=(fd_t&& o) noexcept
+    ref_ptr(const ref_ptr& o) noexcept : ref_ptr(o.p) {}
+    ref_ptr(ref_ptr&& o) noexcept : p(std::exchange(o.p, nullptr)) {}
+
+    ref_ptr& operator=(ref_ptr o) noexcept
     {
-        close();
-        fd = std::exchange(o.fd, -1);
+        std::swap(p, o.p);
         return *this;
     }
 
-    void close()
-    {
-        if (fd != -1 && fd != AT_FDCWD)
-            ::close(std::exchange(fd, -1));
-    }
+    ~ref_ptr() { if (p && --p->refs == 0) delete p; }
+
+    T* get() const noexcept { return p; }
+    T* operator->() const noexcept { return p; }
+    T& operator*() const noexcept { return *p; }
+    explicit operator bool() const noexcept { return p; }
 };
 
-struct dir_t
+template<typename T, typename... Args>
+ref_ptr<T> make_ref(Args&&... args)
+{
+    return ref_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+struct dir_t : ref_counted
 {
     DIR* dir = nullptr;
 
-    dir_t(DIR* dir_) : dir(dir_) {}
+    dir_t(DIR* dir_) noexcept : dir(dir_) {}
 
     ~dir_t() { close(); }
 
@@ -103,14 +197,285 @@ struct dir_t
         return *this;
     }
 
-    void close()
+    void close() noexcept
     {
         if (dir) ::closedir(std::exchange(dir, nullptr));
     }
 };
 
-using shared_fd = std::shared_ptr<fd_t>;
-using shared_dir = std::shared_ptr<dir_t>;
+using shared_dir = ref_ptr<dir_t>;
+
+struct fd_t : ref_counted
+{
+    int fd = -1;
+
+    // Set when fd is the descriptor of an open DIR, which keeps ownership.
+    shared_dir owner = nullptr;
+
+    // Device of the directory, when known.
+    std::optional<::dev_t> dev = std::nullopt;
+
+    fd_t(int fd_) noexcept : fd(fd_) {}
+    fd_t(shared_dir dir) noexcept
+        : fd(::dirfd(dir->dir)), owner(std::move(dir)) {}
+    ~fd_t() { close(); }
+
+    fd_t(const fd_t&) = delete;
+    fd_t& operator=(const fd_t&) = delete;
+
+    fd_t(fd_t&& o) noexcept
+        : fd(std::exchange(o.fd, -1)),
+          owner(std::move(o.owner)),
+          dev(o.dev)
+    { }
+
+    fd_t& operator=(fd_t&& o) noexcept
+    {
+        close();
+        fd = std::exchange(o.fd, -1);
+        owner = std::move(o.owner);
+        dev = o.dev;
+        return *this;
+    }
+
+    void close() noexcept
+    {
+        if (owner)
+            fd = -1, owner = nullptr;
+        else if (fd != -1 && fd != AT_FDCWD)
+            ::close(std::exchange(fd, -1));
+    }
+};
+
+using shared_fd = ref_ptr<fd_t>;
+
+// Limits a rate shared by all threads. Each call takes a token, running
+// into debt when there is none and sleeping it off, so the rate holds
+// even when sleeps overshoot. A rate of 0 leaves it disabled and free.
+class token_bucket
+{
+    using clock = std::chrono::steady_clock;
+
+    std::mutex lock;
+    double rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    clock::time_point last;
+
+    void wait() noexcept
+    {
+        std::unique_lock guard(lock);
+        auto now = clock::now();
+        tokens += std::chrono::duration<double>(now - last).count() * rate;
+        tokens = std::min(tokens, burst) - 1;
+        last = now;
+        if (tokens >= 0) return;
+        auto debt = std::chrono::duration<double>(-tokens / rate);
+        guard.unlock();
+        std::this_thread::sleep_for(debt);
+    }
+
+public:
+    // Allows up to a 20 ms burst of per_sec operations.
+    void set_rate(double per_sec) noexcept
+    {
+        rate = per_sec;
+        burst = std::max(1.0, per_sec / 50);
+        tokens = burst;
+        last = clock::now();
+    }
+
+    void take() noexcept { if (rate > 0) wait(); }
+    bool limited() const noexcept { return rate > 0; }
+};
+
+// Filesystem calls and directories opened by the walk.
+inline token_bucket IopsLimit;
+inline token_bucket DirsLimit;
+
+// How long a single filesystem call may take, 0 when unlimited. A call
+// that takes longer fails with ETIMEDOUT.
+inline std::chrono::milliseconds OpDeadline{ 0 };
+
+// Runs calls one at a time on a detached thread. When a call misses its
+// deadline the thread is left to finish it and the next call starts a new
+// one, a call stuck on a dead mount cannot be interrupted.
+class helper_thread
+{
+    struct state
+    {
+        std::mutex m;
+        std::condition_variable cv;
+        std::function<void()> job;
+        bool done = false;
+        bool quit = false;
+    };
+
+    std::shared_ptr<state> s;
+
+    static void loop(std::shared_ptr<state> s)
+    {
+        std::unique_lock guard(s->m);
+        for (;;)
+        {
+            s->cv.wait(guard, [&] { return s->job || s->quit; });
+            if (!s->job) return;
+            auto job = std::exchange(s->job, nullptr);
+            guard.unlock();
+            job();
+            guard.lock();
+            // What a call given up on captured is never released, the
+            // caller has moved on and may be using the same objects.
+            if (s->quit)
+                return static_cast<void>(new auto(std::move(job)));
+            job = nullptr;
+            s->done = true;
+            s->cv.notify_all();
+            if (s->quit) return;
+        }
+    }
+
+public:
+    helper_thread() = default;
+    helper_thread(const helper_thread&) = delete;
+    helper_thread& operator=(const helper_thread&) = delete;
+
+    ~helper_thread()
+    {
+        if (!s) return;
+        std::lock_guard guard(s->m);
+        s->quit = true;
+        s->cv.notify_all();
+    }
+
+    bool run(std::function<void()> job, std::chrono::milliseconds deadline)
+    {
+        if (!s)
+        {
+            try
+            {
+                auto fresh = std::make_shared<state>();
+                std::thread(loop, fresh).detach();
+                s = std::move(fresh);
+            }
+            catch (const std::exception&)
+            {
+                return false;
+            }
+        }
+        std::unique_lock guard(s->m);
+        s->job = std::move(job);
+        s->done = false;
+        s->cv.notify_all();
+        if (s->cv.wait_for(guard, deadline, [&] { return s->done; }))
+            return true;
+        s->quit = true;
+        guard.unlock();
+        s = nullptr;
+        return false;
+    }
+};
+
+// Runs fn on a helper of the calling thread, false when it did not finish
+// within OpDeadline or no helper could be started. fn must own what it
+// uses, it may finish much later.
+template<typename F>
+bool within_deadline(F fn) noexcept
+{
+    thread_local helper_thread helper;
+    try
+    {
+        return helper.run(std::move(fn), OpDeadline);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+// Devices on which a directory could not be read within the deadline,
+// later directories there fail right away.
+class hung_devices
+{
+    std::mutex lock;
+    std::vector<::dev_t> devs;
+
+public:
+    void add(::dev_t dev)
+    {
+        std::lock_guard guard(lock);
+        if (std::find(devs.begin(), devs.end(), dev) == devs.end())
+            devs.push_back(dev);
+    }
+
+    bool contains(::dev_t dev)
+    {
+        std::lock_guard guard(lock);
+        return std::find(devs.begin(), devs.end(), dev) != devs.end();
+    }
+};
+
+inline hung_devices HungDevices;
+
+// Memory the growing buffers of a walk may take, shared by all threads.
+// Components ask for quota before they grow and, when it is refused, fall
+// back to a cheaper way of working: spilling to temporary files, caching
+// less or keeping fewer requests in flight. What cannot be given up is
+// taken with force() and only counted. Without a limit nothing is refused.
+class memory_budget
+{
+    std::atomic<size_t> used{ 0 };
+    std::atomic<size_t> peak_{ 0 };
+    std::atomic<size_t> refused_{ 0 };
+    size_t limit_ = SIZE_MAX;
+
+    void raise_peak(size_t now) noexcept
+    {
+        size_t p = peak_.load(std::memory_order_relaxed);
+        while (now > p && !peak_.compare_exchange_weak(p, now,
+                                                       std::memory_order_relaxed))
+            ;
+    }
+
+public:
+    void set_limit(size_t n) noexcept { limit_ = n; }
+
+    bool try_reserve(size_t n) noexcept
+    {
+        size_t u = used.load(std::memory_order_relaxed);
+        do
+        {
+            if (n > limit_ || u > limit_ - n)
+            {
+                refused_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        } while (!used.compare_exchange_weak(u, u + n, std::memory_order_relaxed));
+        raise_peak(u + n);
+        return true;
+    }
+
+    void force(size_t n) noexcept
+    {
+        raise_peak(used.fetch_add(n, std::memory_order_relaxed) + n);
+    }
+
+    void release(size_t n) noexcept
+    {
+        used.fetch_sub(n, std::memory_order_relaxed);
+    }
+
+    bool over() const noexcept
+    {
+        return used.load(std::memory_order_relaxed) > limit_;
+    }
+
+    size_t limit() const noexcept { return limit_; }
+    size_t peak() const noexcept { return peak_.load(std::memory_order_relaxed); }
+    size_t refused() const noexcept { return refused_.load(std::memory_order_relaxed); }
+};
+
+inline memory_budget Memory;
 
 using maybe_err = std::optional<err_t>;
 
@@ -125,36 +490,76 @@ struct directory_t
 struct file_t
 {
     shared_fd at = nullptr;
-    ::mode_t mode = 0;
+    struct stat st = {};
     maybe_err err_ = {};
 
     std::string name;
 
-    file_t(shared_fd at_, const std::string& name)
+    file_t(shared_fd at_, const std::string& name) noexcept
         : at(at_), name(name)
     {
-        struct stat st;
-        if (::fstatat(at->fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
-            err_ = sys_err_str("fstatat");
+        IopsLimit.take();
+        if (OpDeadline.count() == 0)
+        {
+            if (::fstatat(at->fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+                err_ = err_t::last(op_t::fstatat);
+            return;
+        }
+
+        // Entries of a directory on a hung device fail without waiting,
+        // a stat that times out marks the device of its directory hung.
+        if (at->dev && HungDevices.contains(*at->dev))
+        {
+            err_ = err_t{ ETIMEDOUT, op_t::fstatat };
+            return;
+        }
+        struct result { struct stat st = {}; maybe_err err; };
+        auto r = std::make_shared<result>();
+        if (!within_deadline([r, at = at, name]
+            {
+                if (::fstatat(at->fd, name.c_str(), &r->st, AT_SYMLINK_NOFOLLOW) == -1)
+                    r->err = err_t::last(op_t::fstatat);
+            }))
+        {
+            err_ = err_t{ ETIMEDOUT, op_t::fstatat };
+            if (at->dev) HungDevices.add(*at->dev);
+        }
         else
-            mode = st.st_mode;
+            st = r->st, err_ = r->err;
     }
 
-    const auto& error() const { return err_; }
+    const auto& error() const noexcept { return err_; }
+
+    static directory_t open_as_dir(int at, const std::string& name) noexcept
+    {
+        DirsLimit.take();
+        IopsLimit.take();
+        if (OpDeadline.count() == 0)
+            return open_dir(at, name);
+
+        // The helper of a call given up on never releases its job, so if
+        // the open completes later, the directory it holds in r stays
+        // open: one descriptor leaks per timed-out call.
+        auto r = std::make_shared<directory_t>();
+        if (!within_deadline([r, at, name] { *r = open_dir(at, name); }))
+            return { nullptr, err_t{ ETIMEDOUT, op_t::openat } };
+        return std::move(*r);
+    }
 
-    static directory_t open_as_dir(int at, const std::string& name)
+    static directory_t open_dir(int at, const std::string& name) noexcept
     {
         int fd = ::openat(at, name.c_str(), O_RDONLY | O_DIRECTORY);
         if (fd == -1)
-            return { nullptr, sys_err_str("openat") };
+            return { nullptr, err_t::last(op_t::openat) };
 
         DIR* dir = ::fdopendir(fd);
         if (!dir)
         {
+            auto err = err_t::last(op_t::fdopendir);
             ::close(fd);
-            return { nullptr, sys_err_str("fdopendir") };
+            return { nullptr, err };
         }
-        return { std::make_shared<dir_t>(dir) };
+        return { make_ref<dir_t>(dir) };
     }
 
     friend std::ostream& operator<<(std::ostream& o, const file_t& f)
@@ -164,42 +569,90 @@ struct file_t
         return o;
     }
 
-    bool is_dir() const { return !err_ && S_ISDIR(mode); }
+    bool is_dir() const noexcept { return !err_ && S_ISDIR(st.st_mode); }
+
+    const char* type_name() const noexcept
+    {
+        if (err_) return "";
+        switch (st.st_mode & S_IFMT)
+        {
+            case S_IFREG:  return "file";
+            case S_IFDIR:  return "dir";
+            case S_IFLNK:  return "symlink";
+            case S_IFIFO:  return "fifo";
+            case S_IFSOCK: return "socket";
+            case S_IFCHR:  return "char";
+            case S_IFBLK:  return "block";
+        }
+        return "other";
+    }
+    bool is_hardlink() const noexcept
+    {
+        return !err_ && !S_ISDIR(st.st_mode) && st.st_nlink > 1;
+    }
 
-    iter_t begin() const;
-    iter_t end() const;
+    iter_t begin(bool skip_hidden = false) const noexcept;
+    iter_t end() const noexcept;
 };
 
+// Reads one entry ahead, so whether the current entry is the last one
+// shown is known without copying the iterator.
 struct iter_t
 {
-    shared_fd at = nullptr;
     directory_t dir;
+    // Descriptor of dir shared with the yielded entries as their 'at'.
+    shared_fd fd = nullptr;
+    bool skip_hidden = false;
     std::optional<std::string> d_name = std::nullopt;
+    std::optional<std::string> ahead = std::nullopt;
     maybe_err err_ = {};
+    maybe_err ahead_err = {};
 
     iter_t() = default;
 
-    iter_t(shared_fd at_, directory_t dir_)
-        : at(at_),
-          dir(dir_),
+    iter_t(directory_t dir_, bool skip_hidden = false) noexcept
+        : dir(std::move(dir_)),
+          skip_hidden(skip_hidden),
           err_(dir.error)
     {
-        if (!err_) ++(*this);
+        if (err_) return;
+        fd = make_ref<fd_t>(dir.dir);
+        ahead = read();
+        ++(*this);
+    }
+
+    const auto& error() const noexcept { return err_; }
+
+    bool is_last() const noexcept { return !ahead && !ahead_err; }
+
+    file_t operator*() const noexcept
+    {
+        return file_t(fd, *d_name);
     }
 
-    const auto& error() const { return dir.error; }
+    iter_t& operator++() noexcept
+    {
+        d_name = std::move(ahead);
+        if (d_name)
+            ahead = read();
+        else if (ahead_err)
+            err_ = std::exchange(ahead_err, std::nullopt);
+        return *this;
+    }
 
-    file_t operator*() const
+    friend bool operator==(const iter_t& a, const iter_t& b) noexcept
     {
-        // omg
-        auto copy = std::make_shared<fd_t>(::dup(::dirfd(dir.dir->dir)));
-        return file_t(copy, d_name.value());
+        return a.d_name == b.d_name;
     }
 
-    iter_t& operator++()
+private:
+    std::optional<std::string> read() noexcept
     {
-        if (!dir.dir)
-            throw sys_errx("++ on null dir");
+        // Reading past the end (or a failed open) stays at the end.
+        if (!dir.dir) return std::nullopt;
+
+        if (OpDeadline.count() != 0)
+            return read_within_deadline();
 
         ::dirent* entry;
         do
@@ -207,145 +660,5787 @@ struct iter_t
             errno = 0;
             entry = ::readdir(dir.dir->dir);
 
-        } while (entry && ( entry->d_name == "."sv
-                         || entry->d_name == ".."sv ));
+        } while (entry && skipped(entry->d_name));
 
         if (!entry && errno != 0)
-        {
-            err_ = sys_err_str("readdir");
-            return *this;
-        }
+            ahead_err = err_t::last(op_t::readdir);
 
-        d_name = entry ? decltype(d_name){ entry->d_name } : std::nullopt;
+        if (!entry) return std::nullopt;
+        return entry->d_name;
+    }
 
-        return *this;
+    bool skipped(const char* name) const noexcept
+    {
+        return name == "."sv || name == ".."sv
+            || ( skip_hidden && name[0] == '.' );
     }
 
-    friend bool operator==(const iter_t& a, const iter_t& b)
+    std::optional<std::string> read_within_deadline() noexcept
     {
-        return a.d_name == b.d_name;
+        struct result { std::optional<std::string> name; maybe_err err; };
+        for (;;)
+        {
+            auto r = std::make_shared<result>();
+            DIR* d = dir.dir->dir;
+            if (!within_deadline([r, d]
+                {
+                    errno = 0;
+                    if (auto entry = ::readdir(d))
+                        r->name = entry->d_name;
+                    else if (errno != 0)
+                        r->err = err_t::last(op_t::readdir);
+                }))
+            {
+                // The helper may still be inside readdir, so d is leaked.
+                dir.dir->dir = nullptr;
+                dir.dir = nullptr;
+                ahead_err = err_t{ ETIMEDOUT, op_t::readdir };
+                return std::nullopt;
+            }
+            ahead_err = r->err;
+            if (!r->name || !skipped(r->name->c_str()))
+                return std::move(r->name);
+        }
     }
 };
 
-iter_t file_t::begin() const
+iter_t file_t::begin(bool skip_hidden) const noexcept
 {
     if (!is_dir()) return end();
-    return iter_t(at, open_as_dir(at->fd, name));
+    if (OpDeadline.count() == 0)
+        return iter_t(open_as_dir(at->fd, name), skip_hidden);
+
+    if (HungDevices.contains(st.st_dev))
+        return iter_t({ nullptr, err_t{ ETIMEDOUT, op_t::openat } });
+    auto it = iter_t(open_as_dir(at->fd, name), skip_hidden);
+    if (it.fd) it.fd->dev = st.st_dev;
+    auto timed_out = [](const maybe_err& e) { return e && e->code == ETIMEDOUT; };
+    if (timed_out(it.error()) || timed_out(it.ahead_err))
+        HungDevices.add(st.st_dev);
+    return it;
 }
-iter_t file_t::end() const { return iter_t(); }
+iter_t file_t::end() const noexcept { return iter_t(); }
 
-class printer
+struct inode_key
 {
-    bool show_hidden = false;
-public:
+    ::dev_t dev;
+    ::ino_t ino;
 
-    printer(bool show_hidden) : show_hidden(show_hidden) {}
+    friend bool operator==(const inode_key&, const inode_key&) = default;
+};
 
-template<typename Node>
-void print_rec(const Node& node, std::vector<bool>& lines,
-               decltype(std::cout)& out, bool first, bool last,
-               int depth = -1)
+struct inode_hash
 {
-    if (depth == 0) return;
-    if (depth == -1) depth = 0;
-    --depth;
+    size_t operator()(const inode_key& k) const
+    {
+        uint64_t h = uint64_t(k.ino) * 0x9e3779b97f4a7c15ull;
+        return size_t(h ^ (uint64_t(k.dev) + (h >> 29)));
+    }
+};
 
-    for (int l : lines)
-        out << (l ? "│   " : "    ");
+struct link_group
+{
+    inode_key key;
+    ::nlink_t nlink;
+    std::vector<std::string> paths;
+};
 
-    // if constexpr (requires{ node.begin(); node.end(); })
-    // {
-    //     if (!first && node.begin().error()) out << (last ? "└╲─ " : "├╲─ ");
-    //     else if (!first)                    out << (last ? "└── " : "├── ");
-    // }
-    // else if (!first) out << (last ? "└── " : "├── ");
-    if (!first) out << (last ? "└── " : "├── ");
-    out << node;
+// Number of errors seen, by errno, printed after a listing or report.
+struct error_summary
+{
+    std::map<int, size_t> counts;
 
-    if (!first) lines.push_back(!last);
+    void add(const err_t& e) noexcept { ++counts[e.code]; }
+    bool empty() const noexcept { return counts.empty(); }
 
-    if constexpr (requires{ node.begin(); node.end(); })
+    void print(std::ostream& out) const
     {
-        auto end = node.end();
-        decltype(end) next;
-        auto it = node.begin();
-
-        if (it.error())
-            out << " " << *std::exchange(it, end).error();
+        if (counts.empty()) return;
 
-        out << "\n";
+        out << "\nerrors:\n";
+        for (auto [code, count] : counts)
+            out << "  " << count << " x (" << code << ") "
+                << std::strerror(code) << "\n";
+    }
+};
 
-        auto is_hidden = [&](const auto& iter)
-        {
-            // if (!show_hidden && !iter.d_name->empty() && iter.d_name->front() == '.')
-            //     return true;
-            // return false;
-            // Need to keep the ending condition, obviously.
-            return iter != end && !it.error()
-                && !show_hidden && !iter.d_name->empty()
-                                && iter.d_name->front() == '.';
-        };
+// Canonical decompositions of the precomposed characters below U+2000,
+// sorted. Each is composed << 32 | first << 16 | second, second is 0 for a
+// singleton; first may itself decompose further. Precomposed characters
+// from U+2000 on, such as U+212B ANGSTROM SIGN and the Hangul syllables,
+// are kept as they are.
+constexpr uint64_t decompositions[] = {
+    0x00c000410300, 0x00c100410301, 0x00c200410302, 0x00c300410303, 0x00c400410308,
+    0x00c50041030a, 0x00c700430327, 0x00c800450300, 0x00c900450301, 0x00ca00450302,
+    0x00cb00450308, 0x00cc00490300, 0x00cd00490301, 0x00ce00490302, 0x00cf00490308,
+    0x00d1004e0303, 0x00d2004f0300, 0x00d3004f0301, 0x00d4004f0302, 0x00d5004f0303,
+    0x00d6004f0308, 0x00d900550300, 0x00da00550301, 0x00db00550302, 0x00dc00550308,
+    0x00dd00590301, 0x00e000610300, 0x00e100610301, 0x00e200610302, 0x00e300610303,
+    0x00e400610308, 0x00e50061030a, 0x00e700630327, 0x00e800650300, 0x00e900650301,
+    0x00ea00650302, 0x00eb00650308, 0x00ec00690300, 0x00ed00690301, 0x00ee00690302,
+    0x00ef00690308, 0x00f1006e0303, 0x00f2006f0300, 0x00f3006f0301, 0x00f4006f0302,
+    0x00f5006f0303, 0x00f6006f0308, 0x00f900750300, 0x00fa00750301, 0x00fb00750302,
+    0x00fc00750308, 0x00fd00790301, 0x00ff00790308, 0x010000410304, 0x010100610304,
+    0x010200410306, 0x010300610306, 0x010400410328, 0x010500610328, 0x010600430301,
+    0x010700630301, 0x010800430302, 0x010900630302, 0x010a00430307, 0x010b00630307,
+    0x010c0043030c, 0x010d0063030c, 0x010e0044030c, 0x010f0064030c, 0x011200450304,
+    0x011300650304, 0x011400450306, 0x011500650306, 0x011600450307, 0x011700650307,
+    0x011800450328, 0x011900650328, 0x011a0045030c, 0x011b0065030c, 0x011c00470302,
+    0x011d00670302, 0x011e00470306, 0x011f00670306, 0x012000470307, 0x012100670307,
+    0x012200470327, 0x012300670327, 0x012400480302, 0x012500680302, 0x012800490303,
+    0x012900690303, 0x012a00490304, 0x012b00690304, 0x012c00490306, 0x012d00690306,
+    0x012e00490328, 0x012f00690328, 0x013000490307, 0x0134004a0302, 0x0135006a0302,
+    0x0136004b0327, 0x0137006b0327, 0x0139004c0301, 0x013a006c0301, 0x013b004c0327,
+    0x013c006c0327, 0x013d004c030c, 0x013e006c030c, 0x0143004e0301, 0x0144006e0301,
+    0x0145004e0327, 0x0146006e0327, 0x0147004e030c, 0x0148006e030c, 0x014c004f0304,
+    0x014d006f0304, 0x014e004f0306, 0x014f006f0306, 0x0150004f030b, 0x0151006f030b,
+    0x015400520301, 0x015500720301, 0x015600520327, 0x015700720327, 0x01580052030c,
+    0x01590072030c, 0x015a00530301, 0x015b00730301, 0x015c00530302, 0x015d00730302,
+    0x015e00530327, 0x015f00730327, 0x01600053030c, 0x01610073030c, 0x016200540327,
+    0x016300740327, 0x01640054030c, 0x01650074030c, 0x016800550303, 0x016900750303,
+    0x016a00550304, 0x016b00750304, 0x016c00550306, 0x016d00750306, 0x016e0055030a,
+    0x016f0075030a, 0x01700055030b, 0x01710075030b, 0x017200550328, 0x017300750328,
+    0x017400570302, 0x017500770302, 0x017600590302, 0x017700790302, 0x017800590308,
+    0x0179005a0301, 0x017a007a0301, 0x017b005a0307, 0x017c007a0307, 0x017d005a030c,
+    0x017e007a030c, 0x01a0004f031b, 0x01a1006f031b, 0x01af0055031b, 0x01b00075031b,
+    0x01cd0041030c, 0x01ce0061030c, 0x01cf0049030c, 0x01d00069030c, 0x01d1004f030c,
+    0x01d2006f030c, 0x01d30055030c, 0x01d40075030c, 0x01d500dc0304, 0x01d600fc0304,
+    0x01d700dc0301, 0x01d800fc0301, 0x01d900dc030c, 0x01da00fc030c, 0x01db00dc0300,
+    0x01dc00fc0300, 0x01de00c40304, 0x01df00e40304, 0x01e002260304, 0x01e102270304,
+    0x01e200c60304, 0x01e300e60304, 0x01e60047030c, 0x01e70067030c, 0x01e8004b030c,
+    0x01e9006b030c, 0x01ea004f0328, 0x01eb006f0328, 0x01ec01ea0304, 0x01ed01eb0304,
+    0x01ee01b7030c, 0x01ef0292030c, 0x01f0006a030c, 0x01f400470301, 0x01f500670301,
+    0x01f8004e0300, 0x01f9006e0300, 0x01fa00c50301, 0x01fb00e50301, 0x01fc00c60301,
+    0x01fd00e60301, 0x01fe00d80301, 0x01ff00f80301, 0x02000041030f, 0x02010061030f,
+    0x020200410311, 0x020300610311, 0x02040045030f, 0x02050065030f, 0x020600450311,
+    0x020700650311, 0x02080049030f, 0x02090069030f, 0x020a00490311, 0x020b00690311,
+    0x020c004f030f, 0x020d006f030f, 0x020e004f0311, 0x020f006f0311, 0x02100052030f,
+    0x02110072030f, 0x021200520311, 0x021300720311, 0x02140055030f, 0x02150075030f,
+    0x021600550311, 0x021700750311, 0x021800530326, 0x021900730326, 0x021a00540326,
+    0x021b00740326, 0x021e0048030c, 0x021f0068030c, 0x022600410307, 0x022700610307,
+    0x022800450327, 0x022900650327, 0x022a00d60304, 0x022b00f60304, 0x022c00d50304,
+    0x022d00f50304, 0x022e004f0307, 0x022f006f0307, 0x0230022e0304, 0x0231022f0304,
+    0x023200590304, 0x023300790304, 0x034003000000, 0x034103010000, 0x034303130000,
+    0x034403080301, 0x037402b90000, 0x037e003b0000, 0x038500a80301, 0x038603910301,
+    0x038700b70000, 0x038803950301, 0x038903970301, 0x038a03990301, 0x038c039f0301,
+    0x038e03a50301, 0x038f03a90301, 0x039003ca0301, 0x03aa03990308, 0x03ab03a50308,
+    0x03ac03b10301, 0x03ad03b50301, 0x03ae03b70301, 0x03af03b90301, 0x03b003cb0301,
+    0x03ca03b90308, 0x03cb03c50308, 0x03cc03bf0301, 0x03cd03c50301, 0x03ce03c90301,
+    0x03d303d20301, 0x03d403d20308, 0x040004150300, 0x040104150308, 0x040304130301,
+    0x040704060308, 0x040c041a0301, 0x040d04180300, 0x040e04230306, 0x041904180306,
+    0x043904380306, 0x045004350300, 0x045104350308, 0x045304330301, 0x045704560308,
+    0x045c043a0301, 0x045d04380300, 0x045e04430306, 0x04760474030f, 0x04770475030f,
+    0x04c104160306, 0x04c204360306, 0x04d004100306, 0x04d104300306, 0x04d204100308,
+    0x04d304300308, 0x04d604150306, 0x04d704350306, 0x04da04d80308, 0x04db04d90308,
+    0x04dc04160308, 0x04dd04360308, 0x04de04170308, 0x04df04370308, 0x04e204180304,
+    0x04e304380304, 0x04e404180308, 0x04e504380308, 0x04e6041e0308, 0x04e7043e0308,
+    0x04ea04e80308, 0x04eb04e90308, 0x04ec042d0308, 0x04ed044d0308, 0x04ee04230304,
+    0x04ef04430304, 0x04f004230308, 0x04f104430308, 0x04f20423030b, 0x04f30443030b,
+    0x04f404270308, 0x04f504470308, 0x04f8042b0308, 0x04f9044b0308, 0x062206270653,
+    0x062306270654, 0x062406480654, 0x062506270655, 0x0626064a0654, 0x06c006d50654,
+    0x06c206c10654, 0x06d306d20654, 0x09290928093c, 0x09310930093c, 0x09340933093c,
+    0x09580915093c, 0x09590916093c, 0x095a0917093c, 0x095b091c093c, 0x095c0921093c,
+    0x095d0922093c, 0x095e092b093c, 0x095f092f093c, 0x09cb09c709be, 0x09cc09c709d7,
+    0x09dc09a109bc, 0x09dd09a209bc, 0x09df09af09bc, 0x0a330a320a3c, 0x0a360a380a3c,
+    0x0a590a160a3c, 0x0a5a0a170a3c, 0x0a5b0a1c0a3c, 0x0a5e0a2b0a3c, 0x0b480b470b56,
+    0x0b4b0b470b3e, 0x0b4c0b470b57, 0x0b5c0b210b3c, 0x0b5d0b220b3c, 0x0b940b920bd7,
+    0x0bca0bc60bbe, 0x0bcb0bc70bbe, 0x0bcc0bc60bd7, 0x0c480c460c56, 0x0cc00cbf0cd5,
+    0x0cc70cc60cd5, 0x0cc80cc60cd6, 0x0cca0cc60cc2, 0x0ccb0cca0cd5, 0x0d4a0d460d3e,
+    0x0d4b0d470d3e, 0x0d4c0d460d57, 0x0dda0dd90dca, 0x0ddc0dd90dcf, 0x0ddd0ddc0dca,
+    0x0dde0dd90ddf, 0x0f430f420fb7, 0x0f4d0f4c0fb7, 0x0f520f510fb7, 0x0f570f560fb7,
+    0x0f5c0f5b0fb7, 0x0f690f400fb5, 0x0f730f710f72, 0x0f750f710f74, 0x0f760fb20f80,
+    0x0f780fb30f80, 0x0f810f710f80, 0x0f930f920fb7, 0x0f9d0f9c0fb7, 0x0fa20fa10fb7,
+    0x0fa70fa60fb7, 0x0fac0fab0fb7, 0x0fb90f900fb5, 0x10261025102e, 0x1b061b051b35,
+    0x1b081b071b35, 0x1b0a1b091b35, 0x1b0c1b0b1b35, 0x1b0e1b0d1b35, 0x1b121b111b35,
+    0x1b3b1b3a1b35, 0x1b3d1b3c1b35, 0x1b401b3e1b35, 0x1b411b3f1b35, 0x1b431b421b35,
+    0x1e0000410325, 0x1e0100610325, 0x1e0200420307, 0x1e0300620307, 0x1e0400420323,
+    0x1e0500620323, 0x1e0600420331, 0x1e0700620331, 0x1e0800c70301, 0x1e0900e70301,
+    0x1e0a00440307, 0x1e0b00640307, 0x1e0c00440323, 0x1e0d00640323, 0x1e0e00440331,
+    0x1e0f00640331, 0x1e1000440327, 0x1e1100640327, 0x1e120044032d, 0x1e130064032d,
+    0x1e1401120300, 0x1e1501130300, 0x1e1601120301, 0x1e1701130301, 0x1e180045032d,
+    0x1e190065032d, 0x1e1a00450330, 0x1e1b00650330, 0x1e1c02280306, 0x1e1d02290306,
+    0x1e1e00460307, 0x1e1f00660307, 0x1e2000470304, 0x1e2100670304, 0x1e2200480307,
+    0x1e2300680307, 0x1e2400480323, 0x1e2500680323, 0x1e2600480308, 0x1e2700680308,
+    0x1e2800480327, 0x1e2900680327, 0x1e2a0048032e, 0x1e2b0068032e, 0x1e2c00490330,
+    0x1e2d00690330, 0x1e2e00cf0301, 0x1e2f00ef0301, 0x1e30004b0301, 0x1e31006b0301,
+    0x1e32004b0323, 0x1e33006b0323, 0x1e34004b0331, 0x1e35006b0331, 0x1e36004c0323,
+    0x1e37006c0323, 0x1e381e360304, 0x1e391e370304, 0x1e3a004c0331, 0x1e3b006c0331,
+    0x1e3c004c032d, 0x1e3d006c032d, 0x1e3e004d0301, 0x1e3f006d0301, 0x1e40004d0307,
+    0x1e41006d0307, 0x1e42004d0323, 0x1e43006d0323, 0x1e44004e0307, 0x1e45006e0307,
+    0x1e46004e0323, 0x1e47006e0323, 0x1e48004e0331, 0x1e49006e0331, 0x1e4a004e032d,
+    0x1e4b006e032d, 0x1e4c00d50301, 0x1e4d00f50301, 0x1e4e00d50308, 0x1e4f00f50308,
+    0x1e50014c0300, 0x1e51014d0300, 0x1e52014c0301, 0x1e53014d0301, 0x1e5400500301,
+    0x1e5500700301, 0x1e5600500307, 0x1e5700700307, 0x1e5800520307, 0x1e5900720307,
+    0x1e5a00520323, 0x1e5b00720323, 0x1e5c1e5a0304, 0x1e5d1e5b0304, 0x1e5e00520331,
+    0x1e5f00720331, 0x1e6000530307, 0x1e6100730307, 0x1e6200530323, 0x1e6300730323,
+    0x1e64015a0307, 0x1e65015b0307, 0x1e6601600307, 0x1e6701610307, 0x1e681e620307,
+    0x1e691e630307, 0x1e6a00540307, 0x1e6b00740307, 0x1e6c00540323, 0x1e6d00740323,
+    0x1e6e00540331, 0x1e6f00740331, 0x1e700054032d, 0x1e710074032d, 0x1e7200550324,
+    0x1e7300750324, 0x1e7400550330, 0x1e7500750330, 0x1e760055032d, 0x1e770075032d,
+    0x1e7801680301, 0x1e7901690301, 0x1e7a016a0308, 0x1e7b016b0308, 0x1e7c00560303,
+    0x1e7d00760303, 0x1e7e00560323, 0x1e7f00760323, 0x1e8000570300, 0x1e8100770300,
+    0x1e8200570301, 0x1e8300770301, 0x1e8400570308, 0x1e8500770308, 0x1e8600570307,
+    0x1e8700770307, 0x1e8800570323, 0x1e8900770323, 0x1e8a00580307, 0x1e8b00780307,
+    0x1e8c00580308, 0x1e8d00780308, 0x1e8e00590307, 0x1e8f00790307, 0x1e90005a0302,
+    0x1e91007a0302, 0x1e92005a0323, 0x1e93007a0323, 0x1e94005a0331, 0x1e95007a0331,
+    0x1e9600680331, 0x1e9700740308, 0x1e980077030a, 0x1e990079030a, 0x1e9b017f0307,
+    0x1ea000410323, 0x1ea100610323, 0x1ea200410309, 0x1ea300610309, 0x1ea400c20301,
+    0x1ea500e20301, 0x1ea600c20300, 0x1ea700e20300, 0x1ea800c20309, 0x1ea900e20309,
+    0x1eaa00c20303, 0x1eab00e20303, 0x1eac1ea00302, 0x1ead1ea10302, 0x1eae01020301,
+    0x1eaf01030301, 0x1eb001020300, 0x1eb101030300, 0x1eb201020309, 0x1eb301030309,
+    0x1eb401020303, 0x1eb501030303, 0x1eb61ea00306, 0x1eb71ea10306, 0x1eb800450323,
+    0x1eb900650323, 0x1eba00450309, 0x1ebb00650309, 0x1ebc00450303, 0x1ebd00650303,
+    0x1ebe00ca0301, 0x1ebf00ea0301, 0x1ec000ca0300, 0x1ec100ea0300, 0x1ec200ca0309,
+    0x1ec300ea0309, 0x1ec400ca0303, 0x1ec500ea0303, 0x1ec61eb80302, 0x1ec71eb90302,
+    0x1ec800490309, 0x1ec900690309, 0x1eca00490323, 0x1ecb00690323, 0x1ecc004f0323,
+    0x1ecd006f0323, 0x1ece004f0309, 0x1ecf006f0309, 0x1ed000d40301, 0x1ed100f40301,
+    0x1ed200d40300, 0x1ed300f40300, 0x1ed400d40309, 0x1ed500f40309, 0x1ed600d40303,
+    0x1ed700f40303, 0x1ed81ecc0302, 0x1ed91ecd0302, 0x1eda01a00301, 0x1edb01a10301,
+    0x1edc01a00300, 0x1edd01a10300, 0x1ede01a00309, 0x1edf01a10309, 0x1ee001a00303,
+    0x1ee101a10303, 0x1ee201a00323, 0x1ee301a10323, 0x1ee400550323, 0x1ee500750323,
+    0x1ee600550309, 0x1ee700750309, 0x1ee801af0301, 0x1ee901b00301, 0x1eea01af0300,
+    0x1eeb01b00300, 0x1eec01af0309, 0x1eed01b00309, 0x1eee01af0303, 0x1eef01b00303,
+    0x1ef001af0323, 0x1ef101b00323, 0x1ef200590300, 0x1ef300790300, 0x1ef400590323,
+    0x1ef500790323, 0x1ef600590309, 0x1ef700790309, 0x1ef800590303, 0x1ef900790303,
+    0x1f0003b10313, 0x1f0103b10314, 0x1f021f000300, 0x1f031f010300, 0x1f041f000301,
+    0x1f051f010301, 0x1f061f000342, 0x1f071f010342, 0x1f0803910313, 0x1f0903910314,
+    0x1f0a1f080300, 0x1f0b1f090300, 0x1f0c1f080301, 0x1f0d1f090301, 0x1f0e1f080342,
+    0x1f0f1f090342, 0x1f1003b50313, 0x1f1103b50314, 0x1f121f100300, 0x1f131f110300,
+    0x1f141f100301, 0x1f151f110301, 0x1f1803950313, 0x1f1903950314, 0x1f1a1f180300,
+    0x1f1b1f190300, 0x1f1c1f180301, 0x1f1d1f190301, 0x1f2003b70313, 0x1f2103b70314,
+    0x1f221f200300, 0x1f231f210300, 0x1f241f200301, 0x1f251f210301, 0x1f261f200342,
+    0x1f271f210342, 0x1f2803970313, 0x1f2903970314, 0x1f2a1f280300, 0x1f2b1f290300,
+    0x1f2c1f280301, 0x1f2d1f290301, 0x1f2e1f280342, 0x1f2f1f290342, 0x1f3003b90313,
+    0x1f3103b90314, 0x1f321f300300, 0x1f331f310300, 0x1f341f300301, 0x1f351f310301,
+    0x1f361f300342, 0x1f371f310342, 0x1f3803990313, 0x1f3903990314, 0x1f3a1f380300,
+    0x1f3b1f390300, 0x1f3c1f380301, 0x1f3d1f390301, 0x1f3e1f380342, 0x1f3f1f390342,
+    0x1f4003bf0313, 0x1f4103bf0314, 0x1f421f400300, 0x1f431f410300, 0x1f441f400301,
+    0x1f451f410301, 0x1f48039f0313, 0x1f49039f0314, 0x1f4a1f480300, 0x1f4b1f490300,
+    0x1f4c1f480301, 0x1f4d1f490301, 0x1f5003c50313, 0x1f5103c50314, 0x1f521f500300,
+    0x1f531f510300, 0x1f541f500301, 0x1f551f510301, 0x1f561f500342, 0x1f571f510342,
+    0x1f5903a50314, 0x1f5b1f590300, 0x1f5d1f590301, 0x1f5f1f590342, 0x1f6003c90313,
+    0x1f6103c90314, 0x1f621f600300, 0x1f631f610300, 0x1f641f600301, 0x1f651f610301,
+    0x1f661f600342, 0x1f671f610342, 0x1f6803a90313, 0x1f6903a90314, 0x1f6a1f680300,
+    0x1f6b1f690300, 0x1f6c1f680301, 0x1f6d1f690301, 0x1f6e1f680342, 0x1f6f1f690342,
+    0x1f7003b10300, 0x1f7103ac0000, 0x1f7203b50300, 0x1f7303ad0000, 0x1f7403b70300,
+    0x1f7503ae0000, 0x1f7603b90300, 0x1f7703af0000, 0x1f7803bf0300, 0x1f7903cc0000,
+    0x1f7a03c50300, 0x1f7b03cd0000, 0x1f7c03c90300, 0x1f7d03ce0000, 0x1f801f000345,
+    0x1f811f010345, 0x1f821f020345, 0x1f831f030345, 0x1f841f040345, 0x1f851f050345,
+    0x1f861f060345, 0x1f871f070345, 0x1f881f080345, 0x1f891f090345, 0x1f8a1f0a0345,
+    0x1f8b1f0b0345, 0x1f8c1f0c0345, 0x1f8d1f0d0345, 0x1f8e1f0e0345, 0x1f8f1f0f0345,
+    0x1f901f200345, 0x1f911f210345, 0x1f921f220345, 0x1f931f230345, 0x1f941f240345,
+    0x1f951f250345, 0x1f961f260345, 0x1f971f270345, 0x1f981f280345, 0x1f991f290345,
+    0x1f9a1f2a0345, 0x1f9b1f2b0345, 0x1f9c1f2c0345, 0x1f9d1f2d0345, 0x1f9e1f2e0345,
+    0x1f9f1f2f0345, 0x1fa01f600345, 0x1fa11f610345, 0x1fa21f620345, 0x1fa31f630345,
+    0x1fa41f640345, 0x1fa51f650345, 0x1fa61f660345, 0x1fa71f670345, 0x1fa81f680345,
+    0x1fa91f690345, 0x1faa1f6a0345, 0x1fab1f6b0345, 0x1fac1f6c0345, 0x1fad1f6d0345,
+    0x1fae1f6e0345, 0x1faf1f6f0345, 0x1fb003b10306, 0x1fb103b10304, 0x1fb21f700345,
+    0x1fb303b10345, 0x1fb403ac0345, 0x1fb603b10342, 0x1fb71fb60345, 0x1fb803910306,
+    0x1fb903910304, 0x1fba03910300, 0x1fbb03860000, 0x1fbc03910345, 0x1fbe03b90000,
+    0x1fc100a80342, 0x1fc21f740345, 0x1fc303b70345, 0x1fc403ae0345, 0x1fc603b70342,
+    0x1fc71fc60345, 0x1fc803950300, 0x1fc903880000, 0x1fca03970300, 0x1fcb03890000,
+    0x1fcc03970345, 0x1fcd1fbf0300, 0x1fce1fbf0301, 0x1fcf1fbf0342, 0x1fd003b90306,
+    0x1fd103b90304, 0x1fd203ca0300, 0x1fd303900000, 0x1fd603b90342, 0x1fd703ca0342,
+    0x1fd803990306, 0x1fd903990304, 0x1fda03990300, 0x1fdb038a0000, 0x1fdd1ffe0300,
+    0x1fde1ffe0301, 0x1fdf1ffe0342, 0x1fe003c50306, 0x1fe103c50304, 0x1fe203cb0300,
+    0x1fe303b00000, 0x1fe403c10313, 0x1fe503c10314, 0x1fe603c50342, 0x1fe703cb0342,
+    0x1fe803a50306, 0x1fe903a50304, 0x1fea03a50300, 0x1feb038e0000, 0x1fec03a10314,
+    0x1fed00a80300, 0x1fee03850000, 0x1fef00600000, 0x1ff21f7c0345, 0x1ff303c90345,
+    0x1ff403ce0345, 0x1ff603c90342, 0x1ff71ff60345, 0x1ff8039f0300, 0x1ff9038c0000,
+    0x1ffa03a90300, 0x1ffb038f0000, 0x1ffc03a90345, 0x1ffd00b40000,
+};
 
-        for (; it != end && !it.error(); it = next)
-        {
-            next = it;
-            // ++next;
-            do { ++next; } while (is_hidden(next));
-            if (!is_hidden(it))
-                print_rec(*it, lines, out, false, next == end, depth);
-        }
+// Appends cp as UTF-8.
+void put_utf8(std::string& out, char32_t cp)
+{
+    if (cp < 0x80)
+        out += char(cp);
+    else if (cp < 0x800)
+        out += char(0xc0 | cp >> 6), out += char(0x80 | (cp & 0x3f));
+    else if (cp < 0x10000)
+        out += char(0xe0 | cp >> 12), out += char(0x80 | (cp >> 6 & 0x3f)),
+        out += char(0x80 | (cp & 0x3f));
+    else
+        out += char(0xf0 | cp >> 18), out += char(0x80 | (cp >> 12 & 0x3f)),
+        out += char(0x80 | (cp >> 6 & 0x3f)), out += char(0x80 | (cp & 0x3f));
+}
 
-        if (it.error())
-            print_rec(*it.error(), lines, out, false, next == end, depth);
+// Decodes one codepoint of s at i. Bytes that are not valid UTF-8 map to
+// U+DC80 to U+DCFF, which no valid sequence decodes to.
+char32_t get_utf8(std::string_view s, size_t& i) noexcept
+{
+    uint8_t b = s[i++];
+    int n = b >= 0xf0 ? 3 : b >= 0xe0 ? 2 : b >= 0xc0 ? 1 : 0;
+    if (b < 0x80 || n == 0 || b > 0xf4 || i + n > s.size())
+        return b < 0x80 ? b : 0xdc00 | b;
+    char32_t cp = b & (0x3f >> n);
+    for (int k = 0; k < n; ++k)
+    {
+        uint8_t c = s[i + k];
+        if ((c & 0xc0) != 0x80) return 0xdc00 | b;
+        cp = cp << 6 | (c & 0x3f);
     }
-
-    if (!first) lines.pop_back();
+    i += n;
+    return cp;
 }
 
-template<typename Node>
-void print(const Node& node, decltype(std::cout)& out = std::cout,
-           int depth = -1)
+// Appends the decomposition of cp, lowercased when fold is set.
+void decompose(std::string& out, char32_t cp, bool fold)
 {
-    std::vector<bool> lines;
-    print_rec(node, lines, out, true, true, depth);
-}
+    static const locale_t utf8 = ::newlocale(LC_CTYPE_MASK, "C.UTF-8", nullptr);
 
-};
+    auto it = std::lower_bound(std::begin(decompositions),
+                               std::end(decompositions), uint64_t(cp) << 32);
+    if (cp < 0x2000 && it != std::end(decompositions) && *it >> 32 == cp)
+    {
+        decompose(out, *it >> 16 & 0xffff, fold);
+        if (*it & 0xffff)
+            decompose(out, *it & 0xffff, fold);
+        return;
+    }
+    if (fold && utf8 && cp < 0xd800)
+        cp = ::towlower_l(cp, utf8);
+    put_utf8(out, cp);
+}
 
-void usage(char** argv)
+// Name with every letter decomposed, and lowercased when fold is set:
+// names with equal keys collide on case-insensitive or normalizing
+// filesystems. Written to k, whose capacity is reused.
+void collision_key(std::string& k, std::string_view name, bool fold)
 {
-    fprintf(stderr, "usage: %s [-h] [-d depth] [DIR...]\n", argv[0]);
+    k.clear();
+    if (std::all_of(name.begin(), name.end(),
+                    [](char c) { return uint8_t(c) < 0x80; }))
+    {
+        for (char c : name)
+            k += fold && c >= 'A' && c <= 'Z' ? char(c | 0x20) : c;
+        return;
+    }
+    for (size_t i = 0; i < name.size(); )
+        decompose(k, get_utf8(name, i), fold);
 }
 
-int main(int argc, char** argv)
+std::string collision_key(std::string_view name, bool fold)
 {
-    int depth = -1;
-    bool show_hidden = false;
+    std::string k;
+    collision_key(k, name, fold);
+    return k;
+}
 
-    auto show = [&](const auto path)
+// Collision keys of the names of one directory, as an open addressed set
+// of their hashes; a matching hash is confirmed by folding the earlier
+// name again. Cleared and reused for the next directory, so a listing
+// allocates nothing per name once the tables have grown.
+class sibling_keys
+{
+    struct slot
     {
-        auto f = file_t(std::make_shared<fd_t>(AT_FDCWD), path);
-        printer(show_hidden).print(f, std::cout, depth);
+        uint64_t hash = 0;  // 0 when free
+        uint32_t name = 0;  // index into starts
     };
 
-    OutputTerminal = bool(isatty(1));
+    std::vector<slot> table = std::vector<slot>(16);
+    std::string names;
+    std::vector<uint32_t> starts = { 0 };
+    std::vector<uint32_t> groups;   // per name, ~0u when it has none
+    std::string key, other;
 
-    const char* optstr = "hd:a";
-    char c;
-    while ((c = getopt(argc, argv, optstr)) != -1)
+    void grow()
     {
-        switch (c)
+        std::vector<slot> bigger(table.size() * 2);
+        for (auto& s : table)
         {
-            case 'h': return usage(argv), 0;
-            case 'd': depth = std::stoi(optarg); break;
-            case 'a': show_hidden = true; break;
-            default: return usage(argv), 1;
+            if (!s.hash) continue;
+            size_t i = s.hash & (bigger.size() - 1);
+            while (bigger[i].hash) i = (i + 1) & (bigger.size() - 1);
+            bigger[i] = s;
         }
+        table = std::move(bigger);
     }
-    argc -= optind - 1;
-    argv += optind - 1;
 
-    if (depth != -1) ++depth;
+public:
+    std::string_view name(uint32_t i) const
+    {
+        return std::string_view(names).substr(starts[i],
+                                              starts[i + 1] - starts[i]);
+    }
+
+    uint32_t& group(uint32_t i) { return groups[i]; }
+
+    // Index of the earlier name colliding with name, if any, name is added
+    // otherwise.
+    std::optional<uint32_t> add(std::string_view name_)
+    {
+        collision_key(key, name_, true);
+        uint64_t hash = std::hash<std::string_view>()(key) | 1;
+        size_t mask = table.size() - 1;
+        size_t i = hash & mask;
+        for (; table[i].hash; i = (i + 1) & mask)
+        {
+            if (table[i].hash != hash) continue;
+            collision_key(other, name(table[i].name), true);
+            if (other == key) return table[i].name;
+        }
+
+        table[i] = { hash, uint32_t(groups.size()) };
+        names += name_;
+        starts.push_back(names.size());
+        groups.push_back(~0u);
+        if (groups.size() * 2 > table.size()) grow();
+        return std::nullopt;
+    }
+
+    void clear()
+    {
+        // Shrunk after a large directory, so clearing stays proportional
+        // to the directories that follow.
+        if (table.size() > 4 * std::max<size_t>(groups.size(), 8))
+            table.assign(std::max<size_t>(16, std::bit_ceil(groups.size() * 2)),
+                         slot());
+        else
+            std::fill(table.begin(), table.end(), slot());
+        names.clear();
+        starts.resize(1);
+        groups.clear();
+    }
+};
+
+struct collision_group
+{
+    std::string dir;
+    std::vector<std::string> names;
+};
+
+class printer
+{
+    bool show_hidden = false;
+    bool show_links = false;
+    bool errors_only = false;
+    bool show_collisions = false;
+
+    error_summary errors;
+
+    // Names listed so far in each open directory, by depth; the tables of
+    // closed directories are kept for the next ones.
+    std::vector<sibling_keys> siblings;
+    size_t open_dirs = 0;
+    std::vector<collision_group> collisions;
+
+    // Hardlinked inodes seen so far, group id is index + 1.
+    std::unordered_map<inode_key, unsigned, inode_hash> link_ids;
+    std::vector<link_group> links;
+    std::string path;
+
+    unsigned link_group_of(const file_t& f) noexcept
+    {
+        auto key = inode_key{ f.st.st_dev, f.st.st_ino };
+        auto [pos, added] = link_ids.try_emplace(key, links.size() + 1);
+        if (added)
+            links.push_back({ key, f.st.st_nlink, {} });
+        links[pos->second - 1].paths.push_back(path);
+        return pos->second;
+    }
+
+    void print_links(decltype(std::cout)& out) const
+    {
+        if (links.empty()) return;
+
+        out << "\nhardlinks:\n";
+        for (unsigned i = 0; i < links.size(); ++i)
+        {
+            const auto& g = links[i];
+            out << "  #" << i + 1 << " inode " << g.key.ino
+                << ", " << g.nlink << " links, "
+                << g.paths.size() << " listed\n";
+            for (const auto& p : g.paths)
+                out << "      " << p << "\n";
+        }
+    }
+
+    // Earlier name of the directory being listed that name collides with,
+    // if any; path is still the directory's.
+    std::optional<std::string_view> collision_of(const std::string& name)
+    {
+        auto& keys = siblings[open_dirs - 1];
+        auto n = keys.add(name);
+        if (!n) return std::nullopt;
+        auto& g = keys.group(*n);
+        if (g == ~0u)
+        {
+            g = collisions.size();
+            collisions.push_back({ path, { std::string(keys.name(*n)) } });
+        }
+        collisions[g].names.push_back(name);
+        return keys.name(*n);
+    }
+
+    void print_collisions(decltype(std::cout)& out) const
+    {
+        if (collisions.empty()) return;
+
+        out << "\ncollisions:\n";
+        for (const auto& g : collisions)
+        {
+            out << "  " << g.dir << ":";
+            for (const auto& n : g.names)
+                out << " '" << n << "'";
+            out << "\n";
+        }
+    }
+
+    bool track_path() const
+    {
+        return show_links || errors_only || show_collisions;
+    }
+
+    void report(const err_t& e, decltype(std::cout)& out) noexcept
+    {
+        errors.add(e);
+        if (errors_only)
+            e.message(out << path << ": ") << "\n";
+    }
+
+public:
+
+    printer(bool show_hidden, bool show_links = false,
+            bool errors_only = false, bool show_collisions = false)
+        : show_hidden(show_hidden),
+          show_links(show_links),
+          errors_only(errors_only),
+          show_collisions(show_collisions) {}
+
+template<typename Node>
+void print_rec(const Node& node, std::vector<bool>& lines,
+               decltype(std::cout)& out, bool first, bool last,
+               int depth = -1) noexcept
+{
+    if (depth == 0) return;
+    if (depth == -1) depth = 0;
+    --depth;
+
+    bool draw = !errors_only;
+
+    if (draw) for (int l : lines)
+        out << (l ? "│   " : "    ");
+
+    // if constexpr (requires{ node.begin(); node.end(); })
+    // {
+    //     if (!first && node.begin().error()) out << (last ? "└╲─ " : "├╲─ ");
+    //     else if (!first)                    out << (last ? "└── " : "├── ");
+    // }
+    // else if (!first) out << (last ? "└── " : "├── ");
+    if (draw && !first) out << (last ? "└── " : "├── ");
+    if (draw) out << node;
+
+    size_t path_len = path.size();
+    if constexpr (requires{ node.is_hardlink(); })
+    {
+        auto collides = show_collisions && !first
+            ? collision_of(node.name) : std::nullopt;
+        if (track_path())
+        {
+            if (!first) path += '/';
+            path += node.name;
+        }
+        if (node.error())
+            report(*node.error(), out);
+        if (show_links && node.is_hardlink())
+        {
+            unsigned id = link_group_of(node);
+            if (draw) out << " [#" << id << "]";
+        }
+        if (collides && draw)
+            out << " [collides with '" << *collides << "']";
+    }
+    else if constexpr (std::is_same_v<Node, err_t>)
+    {
+        report(node, out);
+    }
+    else if constexpr (requires{ node.error(); })
+    {
+        if (node.error())
+            report(*node.error(), out);
+    }
+
+    if (!first) lines.push_back(!last);
+
+    if constexpr (requires{ node.begin(); node.end(); })
+    {
+        // Children of the last displayed level are never shown, so
+        // the directory is not opened at all.
+        auto end = node.end();
+        auto it = depth == 0 ? end : node.begin(!show_hidden);
+
+        if (it.error())
+        {
+            report(*it.error(), out);
+            if (draw) out << " " << *it.error();
+            it = end;
+        }
+
+        if (draw) out << "\n";
+
+        if (show_collisions && ++open_dirs > siblings.size())
+            siblings.emplace_back();
+        for (; it != end; ++it)
+            print_rec(*it, lines, out, false, it.is_last(), depth);
+        if (show_collisions) siblings[--open_dirs].clear();
+
+        if (it.error())
+            print_rec(*it.error(), lines, out, false, true, depth);
+    }
+    else if (draw) out << "\n";
+
+    if (!first) lines.pop_back();
+    path.resize(path_len);
+}
+
+template<typename Node>
+void print(const Node& node, decltype(std::cout)& out = std::cout,
+           int depth = -1) noexcept
+{
+    std::vector<bool> lines;
+    print_rec(node, lines, out, true, true, depth);
+    if (show_links && !errors_only) print_links(out);
+    if (show_collisions && !errors_only) print_collisions(out);
+    errors.print(out);
+}
+
+};
+
+// Path index: locate-style substring search over the full paths of a walk.
+//
+// Every path is stored with the id of its parent, ids are assigned in walk
+// order, so a parent always precedes its children. Each trigram of a path
+// maps to a sorted posting list of path ids. The file is a header followed
+// by flat arrays and is used straight from mmap.
+//
+// Paths are front-coded: each one is stored as varint(length shared with
+// the previous path), varint(length of the rest) and the rest. Every
+// index_block paths the shared length is 0, and those restart points are
+// listed so that any path can be decoded from the start of its block.
+//
+// The mode and ctime of every entry are kept too, and each entry has the
+// ids of its first child and next sibling, so listings are read from the
+// file without building anything.
+//
+// An index built on a base is a delta: it names the base file and holds
+// only the directories whose listing changed, their entries and the
+// directories leading to them. A directory whose listing did not change is
+// linked to its entry in the base, it gets the rest of its children from
+// there. A delta may be the base of another, the chain is composed lazily
+// when it is read: an entry of an older layer is visible unless a newer
+// layer holds its path, or holds a directory above it without a link.
+// Every root is held by every layer. Each layer has its own trigram lists,
+// so a query searches all of them and drops what newer layers replaced.
+//
+// A listing is unchanged when the directory's ctime is the one in the base
+// and older than the build of the base, ctimes are coarse enough that a
+// change in the same tick as the scan would be missed otherwise. Finding
+// changed directories still stats every directory, but files under
+// unchanged ones are neither listed, stat'ed nor written again, so a delta
+// and the time to write it grow with the churn. The mode and ctime of such
+// files are those of the layer that listed them.
+//
+// A build can be limited to shard k of n: the entries right under each root
+// are split by a hash of their name, so n builds, possibly on different
+// hosts, cover disjoint parts of the tree. Merging their indexes appends
+// the paths of each one, the roots they share are kept once.
+//
+// The trigram list is the largest buffer of a build. Under --max-memory it
+// is sorted and spilled to a temporary file whenever it cannot grow, and
+// the spilled runs are merged when the index is written.
+
+struct index_header
+{
+    char magic[8];
+    uint32_t count;         // number of paths
+    uint32_t ngrams;        // number of distinct trigrams
+    uint32_t flags;         // index_hidden
+    uint32_t reserved;
+    int64_t built;          // when the walk started, nanoseconds
+    uint64_t off_base;      // path of the base, 0 for a full index
+    int64_t base_built;     // built of the base
+    uint64_t off_blocks;    // uint64_t[blocks + 1] into data
+    uint64_t off_data;
+    uint64_t off_parents;   // uint32_t[count]
+    uint64_t off_kids;      // uint32_t[count], first child
+    uint64_t off_next;      // uint32_t[count], next sibling or root
+    uint64_t off_links;     // uint64_t[count], layers down << 32 | id,
+                            // 0 for none; 0 in a full index
+    uint64_t off_modes;     // uint32_t[count]
+    uint64_t off_ctimes;    // int64_t[count], nanoseconds
+    uint64_t off_grams;     // index_gram[ngrams + 1]
+    uint64_t off_postings;  // uint32_t[]
+    uint64_t size;
+};
+
+struct index_gram
+{
+    uint32_t gram;
+    uint32_t first;         // into postings, ends at the next gram's first
+};
+
+constexpr char index_magic[8] = { 'T', 'R', 'E', 'E', 'I', 'D', 'X', '4' };
+constexpr uint32_t index_block = 16;
+constexpr uint32_t index_hidden = 1;    // built with hidden entries
+constexpr uint32_t no_parent = UINT32_MAX;
+
+void put_varint(std::string& out, uint64_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        out += char(v | 0x80);
+    out += char(v);
+}
+
+// Reads no further than end, a varint cut short ends there.
+uint64_t get_varint(const char*& p, const char* end) noexcept
+{
+    uint64_t v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    return v;
+}
+
+// Decodes front-coded paths one after another. Lengths that run past end
+// are cut, so a corrupt index gives wrong paths but is never read beyond.
+struct path_cursor
+{
+    const char* p = nullptr;
+    const char* end = nullptr;
+    std::string path = {};
+
+    const std::string& next()
+    {
+        size_t shared = get_varint(p, end);
+        size_t rest = get_varint(p, end);
+        path.resize(std::min(shared, path.size()));
+        rest = std::min<size_t>(rest, end - p);
+        path.append(p, rest);
+        p += rest;
+        return path;
+    }
+};
+
+constexpr uint32_t trigram(const char* p) noexcept
+{
+    return uint32_t(uint8_t(p[0])) << 16
+         | uint32_t(uint8_t(p[1])) << 8
+         | uint32_t(uint8_t(p[2]));
+}
+
+class index_t
+{
+    const char* base = nullptr;
+    size_t size = 0;
+    const index_header* h = nullptr;
+
+    template<typename T>
+    const T* at(uint64_t off) const noexcept
+    {
+        return reinterpret_cast<const T*>(base + off);
+    }
+
+    // Whether n elements of T at off are aligned and inside the file.
+    template<typename T>
+    bool fits(uint64_t off, uint64_t n) const noexcept
+    {
+        return off % alignof(T) == 0 && off <= size
+            && n <= (size - off) / sizeof(T);
+    }
+
+    // Whether every array of the header lies in the file and every id in
+    // it is in range, so that lookups need no checks of their own. Paths
+    // are not decoded here, path_cursor stops at the end of their data.
+    bool valid() const noexcept
+    {
+        uint64_t nblocks = (uint64_t(h->count) + index_block - 1) / index_block + 1;
+        if (!fits<uint64_t>(h->off_blocks, nblocks)
+            || !fits<char>(h->off_data, 0)
+            || !fits<uint32_t>(h->off_parents, h->count)
+            || !fits<uint32_t>(h->off_kids, h->count)
+            || !fits<uint32_t>(h->off_next, h->count)
+            || (h->off_links && !fits<uint64_t>(h->off_links, h->count))
+            || (h->off_base && (h->off_base >= size
+                || !std::memchr(base + h->off_base, 0, size - h->off_base)))
+            || !fits<uint32_t>(h->off_modes, h->count)
+            || !fits<int64_t>(h->off_ctimes, h->count)
+            || !fits<index_gram>(h->off_grams, uint64_t(h->ngrams) + 1)
+            || !fits<uint32_t>(h->off_postings, 0)
+            || h->off_data > h->off_parents)
+            return false;
+
+        auto blocks = at<uint64_t>(h->off_blocks);
+        for (uint64_t i = 0; i < nblocks; ++i)
+            if (blocks[i] > h->off_parents - h->off_data)
+                return false;
+        // Parents come before, children and siblings after, so following
+        // them always ends.
+        auto parents = at<uint32_t>(h->off_parents);
+        auto kids = at<uint32_t>(h->off_kids);
+        auto next = at<uint32_t>(h->off_next);
+        for (uint32_t id = 0; id < h->count; ++id)
+            if ((parents[id] != no_parent && parents[id] >= id)
+                || (kids[id] != no_parent
+                    && (kids[id] <= id || kids[id] >= h->count))
+                || (next[id] != no_parent
+                    && (next[id] <= id || next[id] >= h->count)))
+                return false;
+        // Posting lists end where the next begins, the last entry ends all.
+        auto grams = at<index_gram>(h->off_grams);
+        for (uint32_t i = 0; i < h->ngrams; ++i)
+            if (grams[i].first > grams[i + 1].first)
+                return false;
+        if (!fits<uint32_t>(h->off_postings, grams[h->ngrams].first))
+            return false;
+        auto post = at<uint32_t>(h->off_postings);
+        return std::all_of(post, post + grams[h->ngrams].first,
+                           [&](uint32_t id) { return id < h->count; });
+    }
+
+public:
+    index_t() = default;
+    ~index_t() { if (base) ::munmap(const_cast<char*>(base), size); }
+
+    index_t(const index_t&) = delete;
+    index_t& operator=(const index_t&) = delete;
+
+    maybe_err open(const char* file) noexcept
+    {
+        fd_t fd = ::open(file, O_RDONLY);
+        if (fd.fd == -1)
+            return err_t::last(op_t::open);
+
+        struct stat st;
+        if (::fstat(fd.fd, &st) == -1)
+            return err_t::last(op_t::fstat);
+        if (size_t(st.st_size) < sizeof(index_header))
+            return err_t{ EINVAL, op_t::open };
+
+        void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.fd, 0);
+        if (p == MAP_FAILED)
+            return err_t::last(op_t::mmap);
+        base = static_cast<const char*>(p);
+        size = st.st_size;
+        h = at<index_header>(0);
+
+        if (std::memcmp(h->magic, index_magic, sizeof(h->magic)) != 0
+            || h->size != size || !valid())
+            return err_t{ EINVAL, op_t::open };
+        return {};
+    }
+
+    uint32_t count() const noexcept { return h->count; }
+    uint32_t flags() const noexcept { return h->flags; }
+    int64_t built() const noexcept { return h->built; }
+    int64_t base_built() const noexcept { return h->base_built; }
+
+    // Path of the base as written, null for a full index.
+    const char* base_path() const noexcept
+    {
+        return h->off_base ? base + h->off_base : nullptr;
+    }
+
+    uint32_t first_kid(uint32_t id) const noexcept
+    {
+        return at<uint32_t>(h->off_kids)[id];
+    }
+
+    // Next sibling, or next root for a root.
+    uint32_t next(uint32_t id) const noexcept
+    {
+        return at<uint32_t>(h->off_next)[id];
+    }
+
+    uint64_t link(uint32_t id) const noexcept
+    {
+        return h->off_links ? at<uint64_t>(h->off_links)[id] : 0;
+    }
+
+    uint32_t parent(uint32_t id) const noexcept
+    {
+        return at<uint32_t>(h->off_parents)[id];
+    }
+
+    ::mode_t mode(uint32_t id) const noexcept
+    {
+        return at<uint32_t>(h->off_modes)[id];
+    }
+
+    int64_t ctime(uint32_t id) const noexcept
+    {
+        return at<int64_t>(h->off_ctimes)[id];
+    }
+
+    // Cursor positioned before the first path of id's block.
+    path_cursor block_of(uint32_t id) const noexcept
+    {
+        auto blocks = at<uint64_t>(h->off_blocks);
+        return { base + h->off_data + blocks[id / index_block],
+                 base + h->off_parents };
+    }
+
+    std::string path(uint32_t id) const
+    {
+        auto c = block_of(id);
+        for (uint32_t i = id - id % index_block; i < id; ++i)
+            c.next();
+        return c.next();
+    }
+
+    std::string name(uint32_t id) const
+    {
+        auto p = path(id);
+        if (parent(id) == no_parent) return p;
+        auto len = path(parent(id)).size();
+        return p.substr(p[len] == '/' ? len + 1 : len);
+    }
+
+    // Posting list of a trigram, empty when it does not occur.
+    std::pair<const uint32_t*, const uint32_t*> postings(uint32_t g) const noexcept
+    {
+        auto grams = at<index_gram>(h->off_grams);
+        auto it = std::lower_bound(grams, grams + h->ngrams, g,
+            [](const index_gram& a, uint32_t g) { return a.gram < g; });
+        if (it == grams + h->ngrams || it->gram != g)
+            return { nullptr, nullptr };
+        auto post = at<uint32_t>(h->off_postings);
+        return { post + it->first, post + (it + 1)->first };
+    }
+
+    std::vector<uint32_t> query(std::string_view pattern) const
+    {
+        std::vector<uint32_t> found;
+
+        if (pattern.size() < 3)
+        {
+            auto c = block_of(0);
+            for (uint32_t id = 0; id < count(); ++id)
+                if (c.next().find(pattern) != std::string::npos)
+                    found.push_back(id);
+            return found;
+        }
+
+        std::vector<std::pair<const uint32_t*, const uint32_t*>> lists;
+        for (size_t i = 0; i + 3 <= pattern.size(); ++i)
+        {
+            auto l = postings(trigram(&pattern[i]));
+            if (l.first == l.second) return found;
+            lists.push_back(l);
+        }
+        std::sort(lists.begin(), lists.end(), [](auto& a, auto& b)
+        {
+            return a.second - a.first < b.second - b.first;
+        });
+
+        std::vector<uint32_t> cand(lists[0].first, lists[0].second), next;
+        for (size_t i = 1; i < lists.size() && !cand.empty(); ++i)
+        {
+            next.clear();
+            std::set_intersection(cand.begin(), cand.end(),
+                                  lists[i].first, lists[i].second,
+                                  std::back_inserter(next));
+            cand.swap(next);
+        }
+
+        // Candidates are sorted, the cursor only jumps to a restart point
+        // when that is shorter than decoding on to the next candidate.
+        path_cursor c;
+        uint32_t at_id = UINT32_MAX;
+        for (uint32_t id : cand)
+        {
+            if (at_id > id || id - at_id >= index_block)
+                c = block_of(id), at_id = id - id % index_block;
+            for (; at_id < id; ++at_id)
+                c.next();
+            ++at_id;
+            if (c.next().find(pattern) != std::string::npos)
+                found.push_back(id);
+        }
+        return found;
+    }
+};
+
+// An index and the chain of bases it is a delta of, newest first.
+class index_chain
+{
+    std::vector<std::unique_ptr<index_t>> layers;
+    // Paths to ids of each layer, made when a query needs to know what the
+    // layer replaces in older ones.
+    mutable std::vector<std::unordered_map<std::string, uint32_t>> by_path;
+
+    const std::unordered_map<std::string, uint32_t>& paths(uint32_t layer) const
+    {
+        auto& m = by_path[layer];
+        if (m.empty() && layers[layer]->count())
+        {
+            auto c = layers[layer]->block_of(0);
+            for (uint32_t id = 0; id < layers[layer]->count(); ++id)
+                m.emplace(c.next(), id);
+        }
+        return m;
+    }
+
+    // Whether path, held by layer j, was replaced by no newer layer.
+    bool visible(uint32_t j, std::string_view path) const
+    {
+        uint32_t m = 0;
+        while (m < j)
+        {
+            const auto& held = paths(m);
+            auto p = path;
+            auto it = held.find(std::string(p));
+            while (it == held.end())
+            {
+                auto slash = p.rfind('/');
+                if (slash == p.npos || p == "/") return false;
+                p = p.substr(0, std::max<size_t>(slash, 1));
+                it = held.find(std::string(p));
+            }
+            uint64_t link = layers[m]->link(it->second);
+            if (p.size() == path.size() || link == 0) return false;
+            m += link >> 32;
+        }
+        return m == j;
+    }
+
+public:
+    struct node
+    {
+        uint32_t layer;
+        uint32_t id;
+    };
+
+    // File being opened when open() failed, for messages.
+    std::string at;
+
+    maybe_err open(const char* file)
+    {
+        at = file;
+        for (;;)
+        {
+            auto idx = std::make_unique<index_t>();
+            if (auto err = idx->open(at.c_str()))
+                return err;
+            if (!layers.empty()
+                && (idx->built() != layers.back()->base_built()
+                    || idx->built() >= layers.back()->built()
+                    || idx->flags() != layers.back()->flags()))
+                return err_t{ ESTALE, op_t::open };
+            layers.push_back(std::move(idx));
+            by_path.emplace_back();
+
+            const char* base = layers.back()->base_path();
+            if (!base) break;
+            if (base[0] != '/' && at.rfind('/') != at.npos)
+                at = at.substr(0, at.rfind('/') + 1) + base;
+            else
+                at = base;
+        }
+
+        // Links must point at entries of the layers below.
+        for (uint32_t j = 0; j < layers.size(); ++j)
+            for (uint32_t id = 0; id < layers[j]->count(); ++id)
+                if (uint64_t link = layers[j]->link(id))
+                    if ((link >> 32) == 0 || j + (link >> 32) >= layers.size()
+                        || uint32_t(link) >= layers[j + (link >> 32)]->count())
+                        return at = file, err_t{ EINVAL, op_t::open };
+        return {};
+    }
+
+    const index_t& top() const noexcept { return *layers[0]; }
+    int64_t built(node n) const noexcept { return layers[n.layer]->built(); }
+    ::mode_t mode(node n) const noexcept { return layers[n.layer]->mode(n.id); }
+    int64_t ctime(node n) const noexcept { return layers[n.layer]->ctime(n.id); }
+    std::string path(node n) const { return layers[n.layer]->path(n.id); }
+    std::string name(node n) const { return layers[n.layer]->name(n.id); }
+
+    std::optional<node> parent(node n) const noexcept
+    {
+        uint32_t p = layers[n.layer]->parent(n.id);
+        if (p == no_parent) return std::nullopt;
+        return node{ n.layer, p };
+    }
+
+    std::vector<node> roots() const
+    {
+        std::vector<node> r;
+        for (uint32_t id = top().count() ? 0 : no_parent; id != no_parent;
+             id = top().next(id))
+            r.push_back({ 0, id });
+        return r;
+    }
+
+    // Children held by n's layer, then those of the entry it links to that
+    // the layer does not hold.
+    std::vector<node> kids(node n) const
+    {
+        std::vector<node> r;
+        const auto& l = *layers[n.layer];
+        for (uint32_t k = l.first_kid(n.id); k != no_parent; k = l.next(k))
+            r.push_back({ n.layer, k });
+        uint64_t link = l.link(n.id);
+        if (link == 0) return r;
+
+        std::unordered_set<std::string> held;
+        for (auto k : r)
+            held.insert(name(k));
+        for (auto k : kids({ n.layer + uint32_t(link >> 32), uint32_t(link) }))
+            if (held.empty() || !held.contains(name(k)))
+                r.push_back(k);
+        return r;
+    }
+
+    std::vector<node> query(std::string_view pattern) const
+    {
+        std::vector<node> found;
+        for (uint32_t j = 0; j < layers.size(); ++j)
+            for (uint32_t id : layers[j]->query(pattern))
+                if (visible(j, layers[j]->path(id)))
+                    found.push_back({ j, id });
+        return found;
+    }
+};
+
+int64_t ctime_ns(const struct stat& st) noexcept
+{
+    return int64_t(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+}
+
+// FNV-1a, stable across hosts and builds unlike std::hash.
+constexpr uint64_t fnv1a(std::string_view s) noexcept
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : s)
+        h = (h ^ uint8_t(c)) * 0x100000001b3;
+    return h;
+}
+
+struct file_closer
+{
+    void operator()(std::FILE* f) const noexcept { std::fclose(f); }
+};
+
+using temp_file = std::unique_ptr<std::FILE, file_closer>;
+
+class index_builder
+{
+    bool show_hidden = false;
+    uint32_t shard = 0, shards = 1;
+
+    std::string data;
+    std::string prev;
+    std::vector<uint64_t> blocks;
+    std::vector<uint32_t> parents;
+    std::vector<uint64_t> links;
+    std::vector<uint32_t> modes;
+    std::vector<int64_t> ctimes;
+    // trigram << 32 | path id
+    std::vector<uint64_t> grams;
+    std::unordered_map<std::string, uint32_t> roots;
+    // Number of grams the memory budget allowed, and the sorted runs
+    // spilled when it allowed no more.
+    size_t grams_quota = 0;
+    std::vector<temp_file> runs;
+    bool can_spill = true;
+    // Bytes of the other arrays, counted so that grams spill sooner.
+    size_t accounted = 0;
+
+    int64_t built = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    // The chain this is a delta of, and its path as written in the delta.
+    const index_chain* base = nullptr;
+    std::string base_path;
+
+    // Directories from the root down to the entry being walked. Those under
+    // an unchanged listing are only added once something below changed.
+    struct pending_dir
+    {
+        std::string path;
+        ::mode_t mode;
+        int64_t ctime;
+        uint64_t link;
+        uint32_t id = no_parent;
+    };
+    std::vector<pending_dir> pending;
+
+    uint32_t add(std::string_view path, uint32_t parent,
+                 ::mode_t mode, int64_t ctime, uint64_t link = 0)
+    {
+        uint32_t id = parents.size();
+        size_t shared = 0;
+        if (id % index_block == 0)
+            blocks.push_back(data.size());
+        else
+            while (shared < path.size() && shared < prev.size()
+                   && path[shared] == prev[shared])
+                ++shared;
+        size_t cost = path.size() - shared + 2 + sizeof(uint32_t) * 2
+            + sizeof(int64_t) + (base ? sizeof(uint64_t) : 0)
+            + (parent == no_parent ? path.size() + 64 : 0);
+        Memory.force(cost);
+        accounted += cost;
+        put_varint(data, shared);
+        put_varint(data, path.size() - shared);
+        data += path.substr(shared);
+        prev = path;
+        if (parent == no_parent)
+            roots.emplace(path, id);
+        parents.push_back(parent);
+        if (base) links.push_back(link);
+        modes.push_back(mode);
+        ctimes.push_back(ctime);
+        size_t n = path.size() >= 3 ? path.size() - 2 : 0;
+        if (grams.size() + n > grams_quota)
+            make_room(n);
+        for (size_t i = 0; i + 3 <= path.size(); ++i)
+            grams.push_back(uint64_t(trigram(&path[i])) << 32 | id);
+        return id;
+    }
+
+    // Adds the pending directories that were not yet.
+    void add_pending()
+    {
+        for (size_t i = 0; i < pending.size(); ++i)
+            if (pending[i].id == no_parent)
+                pending[i].id = add(pending[i].path,
+                                    i ? pending[i - 1].id : no_parent,
+                                    pending[i].mode, pending[i].ctime,
+                                    pending[i].link);
+    }
+
+    // Whether name, an entry of the directory being walked, belongs to
+    // this shard.
+    bool in_shard(std::string_view name) const noexcept
+    {
+        return shards == 1 || pending.size() != 1
+            || fnv1a(name) % shards == shard;
+    }
+
+    void make_room(size_t n)
+    {
+        size_t chunk = std::max<size_t>(n, 1 << 16);
+        if (Memory.try_reserve(chunk * sizeof(uint64_t)))
+            return void(grams_quota += chunk);
+        // When spilling fails, the grams stay in memory beyond the budget
+        // rather than being sorted again for every path.
+        if (!can_spill || !spill() || grams_quota < n)
+        {
+            Memory.force(chunk * sizeof(uint64_t));
+            grams_quota += chunk;
+        }
+    }
+
+    void sort_grams()
+    {
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    }
+
+    // Whether the grams were written to a run, they stay in memory when
+    // not and no spill is tried again.
+    bool spill()
+    {
+        if (grams.empty()) return true;
+        temp_file f(std::tmpfile());
+        if (!f) return can_spill = false;
+        sort_grams();
+        if (std::fwrite(grams.data(), sizeof(uint64_t), grams.size(),
+                        f.get()) != grams.size())
+            return can_spill = false;
+        runs.push_back(std::move(f));
+        grams.clear();
+        return true;
+    }
+
+    // Calls emit with every gram of the runs in order.
+    template<typename F>
+    bool merge_runs(F emit)
+    {
+        using head = std::pair<uint64_t, size_t>;   // gram, run
+        std::priority_queue<head, std::vector<head>, std::greater<>> heads;
+        uint64_t g;
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            std::rewind(runs[i].get());
+            if (std::fread(&g, sizeof(g), 1, runs[i].get()) == 1)
+                heads.push({ g, i });
+        }
+        while (!heads.empty())
+        {
+            auto [min, i] = heads.top();
+            heads.pop();
+            emit(min);
+            if (std::fread(&g, sizeof(g), 1, runs[i].get()) == 1)
+                heads.push({ g, i });
+        }
+        return std::all_of(runs.begin(), runs.end(),
+                           [](auto& f) { return !std::ferror(f.get()); });
+    }
+
+    // Walks f, whose previous version is b in the base. An entry is added
+    // when its parent's listing is, listed, or when it changed.
+    void walk(const file_t& f, std::string& path,
+              std::optional<index_chain::node> b, bool listed)
+    {
+        int64_t ctime = f.error() ? 0 : ctime_ns(f.st);
+        bool same = b && f.is_dir() && S_ISDIR(base->mode(*b))
+            && base->ctime(*b) == ctime && ctime < base->built(*b);
+        pending.push_back({ path, f.st.st_mode, ctime,
+                            same ? uint64_t(b->layer + 1) << 32 | b->id : 0 });
+        if (listed || !same)
+            add_pending();
+
+        size_t len = path.size();
+        if (same)
+        {
+            // Only the directories of an unchanged listing can hold changes.
+            for (auto k : base->kids(*b))
+            {
+                if (!S_ISDIR(base->mode(k))) continue;
+                auto name = base->name(k);
+                if (!in_shard(name)) continue;
+                if (path.back() != '/') path += '/';
+                path += name;
+                walk(file_t(make_ref<fd_t>(AT_FDCWD), path), path, k, false);
+                path.resize(len);
+            }
+        }
+        else if (f.is_dir())
+        {
+            std::unordered_map<std::string, index_chain::node> old;
+            if (b)
+                for (auto k : base->kids(*b))
+                    old.emplace(base->name(k), k);
+
+            for (auto it = f.begin(!show_hidden); it != f.end(); ++it)
+            {
+                if (!it.error() && !in_shard(*it.d_name)) continue;
+                if (path.back() != '/') path += '/';
+                path += *it.d_name;
+                auto o = old.find(*it.d_name);
+                walk(*it, path, o == old.end()
+                     ? std::nullopt : std::optional(o->second), true);
+                path.resize(len);
+            }
+        }
+        pending.pop_back();
+    }
+
+public:
+    index_builder(bool show_hidden) : show_hidden(show_hidden) {}
+    ~index_builder()
+    {
+        Memory.release(grams_quota * sizeof(uint64_t) + accounted);
+    }
+
+    index_builder(const index_builder&) = delete;
+    index_builder& operator=(const index_builder&) = delete;
+
+    // Only walk shard k, counted from 0, of n.
+    void set_shard(uint32_t k, uint32_t n)
+    {
+        shard = k;
+        shards = n;
+    }
+
+    // Writes a delta of chain, found at path from the directory of the
+    // delta. A chain built with other options is not used.
+    void set_base(const index_chain& chain, std::string path)
+    {
+        if (bool(chain.top().flags() & index_hidden) != show_hidden) return;
+        base = &chain;
+        base_path = std::move(path);
+    }
+
+    void add_root(std::string path)
+    {
+        while (path.size() > 1 && path.back() == '/')
+            path.pop_back();
+
+        std::optional<index_chain::node> b;
+        for (auto r : base ? base->roots() : std::vector<index_chain::node>())
+            if (base->path(r) == path)
+                b = r;
+
+        walk(file_t(make_ref<fd_t>(AT_FDCWD), path), path, b, true);
+    }
+
+    // Appends the paths of an index, composing a delta with its bases, and
+    // takes its options; the caller checks all indexes merged agree.
+    maybe_err merge(const index_chain& chain)
+    {
+        const auto& idx = chain.top();
+        show_hidden = idx.flags() & index_hidden;
+
+        if (idx.base_path())
+        {
+            for (auto r : chain.roots())
+                merge(chain, r, no_parent);
+            return {};
+        }
+
+        // A full index is appended in its own order.
+        std::vector<uint32_t> ids(idx.count());
+        auto c = idx.block_of(0);
+        for (uint32_t id = 0; id < idx.count(); ++id)
+        {
+            const auto& path = c.next();
+            uint32_t parent = idx.parent(id);
+            auto root = parent == no_parent ? roots.find(path) : roots.end();
+            if (root != roots.end())
+            {
+                ids[id] = root->second;
+                continue;
+            }
+            ids[id] = add(path, parent == no_parent ? no_parent : ids[parent],
+                          idx.mode(id), idx.ctime(id));
+        }
+        return {};
+    }
+
+    void merge(const index_chain& chain, index_chain::node n, uint32_t parent)
+    {
+        auto path = chain.path(n);
+        auto root = parent == no_parent ? roots.find(path) : roots.end();
+        uint32_t id = root != roots.end() ? root->second
+            : add(path, parent, chain.mode(n), chain.ctime(n));
+        for (auto k : chain.kids(n))
+            merge(chain, k, id);
+    }
+
+    maybe_err write(const char* file)
+    {
+        // Spilled postings go to a file of their own, they come last.
+        std::vector<index_gram> table;
+        std::vector<uint32_t> postings;
+        temp_file spilled;
+        uint32_t npostings = 0;
+        auto emit = [&](uint64_t g)
+        {
+            if (table.empty() || table.back().gram != uint32_t(g >> 32))
+                table.push_back({ uint32_t(g >> 32), npostings });
+            uint32_t id = g;
+            if (spilled) std::fwrite(&id, sizeof(id), 1, spilled.get());
+            else postings.push_back(id);
+            ++npostings;
+        };
+
+        if (runs.empty())
+        {
+            sort_grams();
+            postings.reserve(grams.size());
+            for (uint64_t g : grams)
+                emit(g);
+        }
+        else
+        {
+            if (!spill())
+                return err_t::last(op_t::write);
+            spilled.reset(std::tmpfile());
+            if (!spilled)
+                return err_t::last(op_t::open);
+            if (!merge_runs(emit) || std::fflush(spilled.get()) != 0
+                || std::ferror(spilled.get()))
+                return err_t::last(op_t::write);
+            std::rewind(spilled.get());
+        }
+        uint32_t ngrams = table.size();
+        table.push_back({ UINT32_MAX, npostings });
+
+        auto align = [](uint64_t off) { return (off + 7) & ~uint64_t(7); };
+        blocks.push_back(data.size());
+
+        // Children and siblings, the roots being siblings of each other.
+        std::vector<uint32_t> kids(parents.size(), no_parent);
+        std::vector<uint32_t> next(parents.size(), no_parent);
+        uint32_t first_root = no_parent;
+        for (uint32_t id = parents.size(); id-- > 0; )
+        {
+            auto& first = parents[id] == no_parent ? first_root
+                                                   : kids[parents[id]];
+            next[id] = first;
+            first = id;
+        }
+
+        index_header h = {};
+        std::memcpy(h.magic, index_magic, sizeof(h.magic));
+        h.count = parents.size();
+        h.ngrams = ngrams;
+        h.flags = show_hidden ? index_hidden : 0;
+        h.built = built;
+        h.off_blocks = sizeof(h);
+        if (base)
+        {
+            h.off_base = sizeof(h);
+            h.base_built = base->top().built();
+            h.off_blocks = align(h.off_base + base_path.size() + 1);
+        }
+        h.off_data = align(h.off_blocks + blocks.size() * sizeof(uint64_t));
+        h.off_parents = align(h.off_data + data.size());
+        h.off_kids = align(h.off_parents + parents.size() * sizeof(uint32_t));
+        h.off_next = align(h.off_kids + kids.size() * sizeof(uint32_t));
+        h.off_links = base ? align(h.off_next + next.size() * sizeof(uint32_t)) : 0;
+        h.off_modes = align((base ? h.off_links + links.size() * sizeof(uint64_t)
+                                  : h.off_next + next.size() * sizeof(uint32_t)));
+        h.off_ctimes = align(h.off_modes + modes.size() * sizeof(uint32_t));
+        h.off_grams = align(h.off_ctimes + ctimes.size() * sizeof(int64_t));
+        h.off_postings = align(h.off_grams + table.size() * sizeof(index_gram));
+        h.size = h.off_postings + uint64_t(npostings) * sizeof(uint32_t);
+
+        // Written aside and renamed, so a reader never maps a partial file.
+        auto tmp = std::string(file) + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return err_t::last(op_t::open);
+        auto fail = [&](op_t op)
+        {
+            auto err = err_t::last(op);
+            out.close();
+            ::unlink(tmp.c_str());
+            return err;
+        };
+
+        auto put = [&](uint64_t off, const void* p, size_t n)
+        {
+            static constexpr char zeros[8] = {};
+            out.write(zeros, off - out.tellp());
+            out.write(static_cast<const char*>(p), n);
+        };
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        if (base)
+            put(h.off_base, base_path.c_str(), base_path.size() + 1);
+        put(h.off_blocks, blocks.data(), blocks.size() * sizeof(uint64_t));
+        put(h.off_data, data.data(), data.size());
+        put(h.off_parents, parents.data(), parents.size() * sizeof(uint32_t));
+        put(h.off_kids, kids.data(), kids.size() * sizeof(uint32_t));
+        put(h.off_next, next.data(), next.size() * sizeof(uint32_t));
+        if (base)
+            put(h.off_links, links.data(), links.size() * sizeof(uint64_t));
+        put(h.off_modes, modes.data(), modes.size() * sizeof(uint32_t));
+        put(h.off_ctimes, ctimes.data(), ctimes.size() * sizeof(int64_t));
+        put(h.off_grams, table.data(), table.size() * sizeof(index_gram));
+        put(h.off_postings, postings.data(), postings.size() * sizeof(uint32_t));
+        if (spilled)
+        {
+            char buf[64 * 1024];
+            while (size_t n = std::fread(buf, 1, sizeof(buf), spilled.get()))
+                out.write(buf, n);
+            if (std::ferror(spilled.get()))
+                return fail(op_t::write);
+        }
+
+        if (!out.flush())
+            return fail(op_t::write);
+        out.close();
+        if (::rename(tmp.c_str(), file) == -1)
+            return fail(op_t::rename);
+        return {};
+    }
+};
+
+// A subset of the indexed paths shaped as a tree, so that matches can be
+// shown through printer together with the directories leading to them.
+class index_view
+{
+    // Children of each shown path, and the name of each.
+    std::unordered_map<std::string, std::vector<std::string>> children;
+    std::unordered_map<std::string, std::string> names;
+    std::vector<std::string> roots_;
+    static inline const std::vector<std::string> none;
+
+public:
+    struct node;
+
+    struct iter
+    {
+        const index_view* view = nullptr;
+        const std::string* p = nullptr;
+        const std::string* e = nullptr;
+
+        const maybe_err& error() const noexcept
+        {
+            static const maybe_err no_error;
+            return no_error;
+        }
+        bool is_last() const noexcept { return p + 1 == e; }
+        node operator*() const noexcept { return { view, p }; }
+        iter& operator++() noexcept { ++p; return *this; }
+
+        friend bool operator==(const iter& a, const iter& b) noexcept
+        {
+            return a.p == b.p;
+        }
+    };
+
+    struct node
+    {
+        const index_view* view;
+        const std::string* path;
+
+        iter begin(bool = false) const noexcept
+        {
+            const auto& c = view->kids(*path);
+            return { view, c.data(), c.data() + c.size() };
+        }
+        iter end() const noexcept
+        {
+            const auto& c = view->kids(*path);
+            return { view, c.data() + c.size(), c.data() + c.size() };
+        }
+
+        friend std::ostream& operator<<(std::ostream& o, const node& n)
+        {
+            return o << n.view->name(*n.path);
+        }
+    };
+
+    // Takes the matching entries, adds all their ancestors. Entries of
+    // different layers only meet by path, siblings are sorted by name.
+    index_view(const index_chain& chain,
+               const std::vector<index_chain::node>& found)
+    {
+        for (auto n : found)
+        {
+            std::optional<index_chain::node> at = n;
+            auto path = chain.path(n);
+            while (at && names.emplace(path, chain.name(*at)).second)
+            {
+                auto parent = chain.parent(*at);
+                if (!parent) break;
+                auto parent_path = chain.path(*parent);
+                children[parent_path].push_back(path);
+                at = parent, path = std::move(parent_path);
+            }
+        }
+        for (auto& [parent, kids] : children)
+            std::sort(kids.begin(), kids.end());
+        for (auto r : chain.roots())
+            if (auto path = chain.path(r); names.contains(path))
+                roots_.push_back(path);
+    }
+
+    std::string_view name(const std::string& path) const noexcept
+    {
+        return names.find(path)->second;
+    }
+
+    const std::vector<std::string>& kids(const std::string& path) const noexcept
+    {
+        auto it = children.find(path);
+        return it == children.end() ? none : it->second;
+    }
+
+    std::vector<node> roots() const
+    {
+        std::vector<node> r;
+        for (const auto& path : roots_) r.push_back({ this, &path });
+        return r;
+    }
+};
+
+// Arrow IPC file output, one row per entry of the walk.
+//
+// The metadata is FlatBuffers encoded by fb_builder below, which supports
+// just what the Arrow schema needs. Rows are collected into record batches
+// of arrow_batch_rows, each batch is written as soon as it is full.
+
+// Builds a FlatBuffer back to front, like the reference implementation:
+// children are finished before the tables pointing at them, so every
+// offset points forward. Positions are distances from the end of the
+// buffer, which do not change as more is prepended.
+class fb_builder
+{
+    std::string buf;
+    std::vector<std::pair<uint16_t, uint32_t>> fields;  // id, position
+    size_t table_start = 0;
+
+    void pad(size_t align, size_t extra = 0)
+    {
+        buf.insert(0, (align - (buf.size() + extra) % align) % align, '\0');
+    }
+
+    void prepend(const void* p, size_t n)
+    {
+        buf.insert(0, static_cast<const char*>(p), n);
+    }
+
+    template<typename T>
+    void push(T v)
+    {
+        pad(sizeof(T));
+        prepend(&v, sizeof(T));
+    }
+
+    void push_offset(uint32_t target)
+    {
+        pad(4);
+        push(uint32_t(buf.size() + 4 - target));
+    }
+
+public:
+    uint32_t string(std::string_view s)
+    {
+        pad(4, s.size() + 1);
+        buf.insert(0, 1, '\0');
+        prepend(s.data(), s.size());
+        push(uint32_t(s.size()));
+        return buf.size();
+    }
+
+    uint32_t offsets(const std::vector<uint32_t>& targets)
+    {
+        pad(4, targets.size() * 4);
+        for (auto t = targets.rbegin(); t != targets.rend(); ++t)
+            push_offset(*t);
+        push(uint32_t(targets.size()));
+        return buf.size();
+    }
+
+    // Vector of structs of elem bytes each, which are all 8-aligned here.
+    uint32_t structs(const void* data, size_t count, size_t elem)
+    {
+        pad(8, count * elem);
+        prepend(data, count * elem);
+        push(uint32_t(count));
+        return buf.size();
+    }
+
+    void start_table()
+    {
+        fields.clear();
+        table_start = buf.size();
+    }
+
+    template<typename T>
+    void add(uint16_t id, T v)
+    {
+        push(v);
+        fields.emplace_back(id, buf.size());
+    }
+
+    void add_offset(uint16_t id, uint32_t target)
+    {
+        push_offset(target);
+        fields.emplace_back(id, buf.size());
+    }
+
+    uint32_t end_table()
+    {
+        push(int32_t(0));
+        uint32_t table = buf.size();
+
+        uint16_t nslots = 0;
+        for (auto [id, pos] : fields)
+            nslots = std::max<uint16_t>(nslots, id + 1);
+
+        std::vector<uint16_t> vt(2 + nslots, 0);
+        vt[0] = vt.size() * 2;
+        vt[1] = table - table_start;
+        for (auto [id, pos] : fields)
+            vt[2 + id] = table - pos;
+        prepend(vt.data(), vt.size() * 2);
+
+        int32_t soffset = buf.size() - table;
+        std::memcpy(&buf[buf.size() - table], &soffset, 4);
+        return table;
+    }
+
+    std::string finish(uint32_t root)
+    {
+        pad(8, 4);
+        push_offset(root);
+        return std::move(buf);
+    }
+};
+
+constexpr size_t arrow_batch_rows = 64 * 1024;
+
+class arrow_writer
+{
+    // Message.fbs, Schema.fbs
+    enum : uint8_t { header_schema = 1, header_record_batch = 3 };
+    enum : uint8_t { type_int = 2, type_binary = 4, type_utf8 = 5,
+                      type_timestamp = 10 };
+    static constexpr int16_t metadata_v5 = 4;
+    static constexpr int16_t unit_ns = 3;
+
+    struct fixed_col
+    {
+        const char* name;
+        uint8_t width;      // bytes
+        bool is_signed;
+        bool timestamp;
+        bool nullable;
+        std::string values = {};
+        std::string valid = {};
+        int64_t nulls = 0;
+    };
+
+    // Utf8 and Binary share a layout; names are raw bytes, so only columns
+    // with fixed ASCII values are declared Utf8.
+    struct utf8_col
+    {
+        const char* name;
+        uint8_t type;
+        bool nullable = false;
+        std::vector<int32_t> offsets = { 0 };
+        std::string data = {};
+        std::string valid = {};
+        int64_t nulls = 0;
+    };
+
+    // Column order: id, parent, name, type, size, mtime, uid, mode, error.
+    // A directory that fails to open or read gets a child row of type
+    // "error", an entry that fails to stat has its error on its own row.
+    fixed_col id_col = { "id", 4, false, false, false };
+    fixed_col parent_col = { "parent", 4, false, false, true };
+    utf8_col name_col = { "name", type_binary };
+    utf8_col type_col = { "type", type_utf8 };
+    fixed_col size_col = { "size", 8, true, false, true };
+    fixed_col mtime_col = { "mtime", 8, true, true, true };
+    fixed_col uid_col = { "uid", 4, false, false, true };
+    fixed_col mode_col = { "mode", 4, false, false, true };
+    utf8_col error_col = { "error", type_utf8, true };
+
+    std::ofstream out;
+    size_t rows = 0;
+    uint32_t next_id = 0;
+    // Bytes of the batch being collected, flushed early when the memory
+    // budget refuses more.
+    size_t batch_bytes = 0;
+    bool show_hidden = false;
+    error_summary errors;
+
+    struct block { int64_t offset; int32_t meta; int32_t pad; int64_t body; };
+    std::vector<block> blocks;
+
+    struct field_node { int64_t length; int64_t nulls; };
+    struct buffer { int64_t offset; int64_t length; };
+
+    template<typename T>
+    void put(fixed_col& c, T v, bool valid)
+    {
+        if (c.valid.size() * 8 <= rows)
+            c.valid += '\0';
+        if (valid)
+            c.valid.back() |= char(1 << (rows % 8));
+        else
+            ++c.nulls, v = 0;
+        c.values.append(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    static void put(utf8_col& c, std::string_view s)
+    {
+        c.data += s;
+        c.offsets.push_back(c.data.size());
+    }
+
+    void put(utf8_col& c, std::string_view s, bool valid)
+    {
+        if (c.valid.size() * 8 <= rows)
+            c.valid += '\0';
+        if (valid)
+            c.valid.back() |= char(1 << (rows % 8));
+        else
+            ++c.nulls;
+        put(c, s);
+    }
+
+    uint32_t field(fb_builder& fb, const char* name, uint8_t type,
+                   uint32_t type_table, bool nullable)
+    {
+        uint32_t n = fb.string(name);
+        uint32_t children = fb.offsets({});
+        fb.start_table();
+        fb.add_offset(0, n);
+        fb.add(1, uint8_t(nullable));
+        fb.add(2, type);
+        fb.add_offset(3, type_table);
+        fb.add_offset(5, children);
+        return fb.end_table();
+    }
+
+    uint32_t field(fb_builder& fb, const fixed_col& c)
+    {
+        uint32_t type;
+        if (c.timestamp)
+        {
+            uint32_t tz = fb.string("UTC");
+            fb.start_table();
+            fb.add(0, unit_ns);
+            fb.add_offset(1, tz);
+            type = fb.end_table();
+        }
+        else
+        {
+            fb.start_table();
+            fb.add(0, int32_t(c.width * 8));
+            fb.add(1, uint8_t(c.is_signed));
+            type = fb.end_table();
+        }
+        return field(fb, c.name, c.timestamp ? type_timestamp : type_int,
+                     type, c.nullable);
+    }
+
+    uint32_t field(fb_builder& fb, const utf8_col& c)
+    {
+        fb.start_table();
+        return field(fb, c.name, c.type, fb.end_table(), c.nullable);
+    }
+
+    uint32_t schema(fb_builder& fb)
+    {
+        std::vector<uint32_t> fields = {
+            field(fb, id_col), field(fb, parent_col),
+            field(fb, name_col), field(fb, type_col),
+            field(fb, size_col), field(fb, mtime_col),
+            field(fb, uid_col), field(fb, mode_col),
+            field(fb, error_col),
+        };
+        uint32_t list = fb.offsets(fields);
+        fb.start_table();
+        fb.add_offset(1, list);
+        return fb.end_table();
+    }
+
+    std::string message(uint8_t kind, uint32_t header, fb_builder& fb,
+                        int64_t body)
+    {
+        fb.start_table();
+        fb.add(3, body);
+        fb.add(0, metadata_v5);
+        fb.add(1, kind);
+        fb.add_offset(2, header);
+        return fb.finish(fb.end_table());
+    }
+
+    // Writes an encapsulated message, returns its metadata length.
+    int32_t write_message(const std::string& meta, const std::string& body)
+    {
+        static constexpr char zeros[8] = {};
+        int32_t len = (meta.size() + 7) & ~size_t(7);
+        uint32_t cont = 0xffffffff;
+        out.write(reinterpret_cast<const char*>(&cont), 4);
+        out.write(reinterpret_cast<const char*>(&len), 4);
+        out.write(meta.data(), meta.size());
+        out.write(zeros, len - meta.size());
+        out.write(body.data(), body.size());
+        return len + 8;
+    }
+
+    void flush_batch()
+    {
+        if (rows == 0) return;
+
+        std::string body;
+        std::vector<field_node> nodes;
+        std::vector<buffer> buffers;
+
+        auto add_buffer = [&](const void* p, size_t n)
+        {
+            buffers.push_back({ int64_t(body.size()), int64_t(n) });
+            body.append(static_cast<const char*>(p), n);
+            body.resize((body.size() + 7) & ~size_t(7));
+        };
+        auto add_fixed = [&](fixed_col& c)
+        {
+            nodes.push_back({ int64_t(rows), c.nulls });
+            if (c.nulls) add_buffer(c.valid.data(), c.valid.size());
+            else add_buffer(nullptr, 0);
+            add_buffer(c.values.data(), c.values.size());
+            c.values.clear(), c.valid.clear(), c.nulls = 0;
+        };
+        auto add_utf8 = [&](utf8_col& c)
+        {
+            nodes.push_back({ int64_t(rows), c.nulls });
+            if (c.nulls) add_buffer(c.valid.data(), c.valid.size());
+            else add_buffer(nullptr, 0);
+            add_buffer(c.offsets.data(), c.offsets.size() * sizeof(int32_t));
+            add_buffer(c.data.data(), c.data.size());
+            c.offsets = { 0 }, c.data.clear(), c.valid.clear(), c.nulls = 0;
+        };
+        add_fixed(id_col);
+        add_fixed(parent_col);
+        add_utf8(name_col);
+        add_utf8(type_col);
+        add_fixed(size_col);
+        add_fixed(mtime_col);
+        add_fixed(uid_col);
+        add_fixed(mode_col);
+        add_utf8(error_col);
+
+        fb_builder fb;
+        uint32_t b = fb.structs(buffers.data(), buffers.size(), sizeof(buffer));
+        uint32_t n = fb.structs(nodes.data(), nodes.size(), sizeof(field_node));
+        fb.start_table();
+        fb.add(0, int64_t(rows));
+        fb.add_offset(1, n);
+        fb.add_offset(2, b);
+        uint32_t batch = fb.end_table();
+        auto meta = message(header_record_batch, batch, fb, body.size());
+
+        int64_t offset = out.tellp();
+        int32_t len = write_message(meta, body);
+        blocks.push_back({ offset, len, 0, int64_t(body.size()) });
+        rows = 0;
+        Memory.release(batch_bytes);
+        batch_bytes = 0;
+    }
+
+    void reserve(size_t cost)
+    {
+        if (!Memory.try_reserve(cost))
+        {
+            flush_batch();
+            Memory.force(cost);
+        }
+        batch_bytes += cost;
+    }
+
+    void end_row()
+    {
+        if (++rows == arrow_batch_rows)
+            flush_batch();
+    }
+
+    void row(const file_t& f, uint32_t id, uint32_t parent)
+    {
+        std::string error = f.error() ? f.error()->text() : std::string();
+        reserve(64 + f.name.size() + error.size());
+
+        bool ok = !f.error();
+        put(id_col, id, true);
+        put(parent_col, parent, parent != no_parent);
+        put(name_col, f.name);
+        put(type_col, f.type_name());
+        put(size_col, int64_t(f.st.st_size), ok);
+        put(mtime_col, int64_t(f.st.st_mtim.tv_sec) * 1000000000
+                     + f.st.st_mtim.tv_nsec, ok);
+        put(uid_col, uint32_t(f.st.st_uid), ok);
+        put(mode_col, uint32_t(f.st.st_mode), ok);
+        put(error_col, error, !ok);
+        if (!ok) errors.add(*f.error());
+        end_row();
+    }
+
+    void error_row(const err_t& e, uint32_t parent)
+    {
+        std::string error = e.text();
+        reserve(64 + error.size());
+
+        put(id_col, next_id++, true);
+        put(parent_col, parent, true);
+        put(name_col, "");
+        put(type_col, "error");
+        put(size_col, int64_t(0), false);
+        put(mtime_col, int64_t(0), false);
+        put(uid_col, uint32_t(0), false);
+        put(mode_col, uint32_t(0), false);
+        put(error_col, error, true);
+        errors.add(e);
+        end_row();
+    }
+
+    void walk(const file_t& f, uint32_t parent)
+    {
+        uint32_t id = next_id++;
+        row(f, id, parent);
+        auto it = f.begin(!show_hidden);
+        for (; it != f.end(); ++it)
+            walk(*it, id);
+        if (it.error()) error_row(*it.error(), id);
+    }
+
+public:
+    arrow_writer(bool show_hidden) : show_hidden(show_hidden) {}
+    ~arrow_writer() { Memory.release(batch_bytes); }
+
+    maybe_err open(const char* file)
+    {
+        out.open(file, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return err_t::last(op_t::open);
+
+        out.write("ARROW1\0\0", 8);
+        fb_builder fb;
+        uint32_t s = schema(fb);
+        write_message(message(header_schema, s, fb, 0), {});
+        return {};
+    }
+
+    void add_root(const char* path)
+    {
+        walk(file_t(make_ref<fd_t>(AT_FDCWD), path), no_parent);
+    }
+
+    maybe_err close()
+    {
+        flush_batch();
+
+        uint32_t eos[2] = { 0xffffffff, 0 };
+        out.write(reinterpret_cast<const char*>(eos), sizeof(eos));
+
+        fb_builder fb;
+        uint32_t b = fb.structs(blocks.data(), blocks.size(), sizeof(block));
+        uint32_t d = fb.structs(nullptr, 0, sizeof(block));
+        uint32_t s = schema(fb);
+        fb.start_table();
+        fb.add(0, metadata_v5);
+        fb.add_offset(1, s);
+        fb.add_offset(2, d);
+        fb.add_offset(3, b);
+        auto footer = fb.finish(fb.end_table());
+
+        int32_t len = footer.size();
+        out.write(footer.data(), footer.size());
+        out.write(reinterpret_cast<const char*>(&len), 4);
+        out.write("ARROW1", 6);
+
+        if (!out.flush())
+            return err_t::last(op_t::write);
+        return {};
+    }
+
+    const error_summary& walk_errors() const noexcept { return errors; }
+};
+
+// Size estimation by random descents (Knuth's estimator).
+//
+// A descent starts at the root and repeatedly moves to a directory chosen
+// uniformly among the subdirectories of the current one. With weight w for
+// the current directory (1 at the root), its entries, files and bytes count
+// w times, and the chosen subdirectory gets weight w * (number of
+// subdirectories). Every descent is an unbiased estimate of the totals;
+// their mean and spread give the estimate and its confidence interval.
+
+class estimator
+{
+    // Listings are kept, the upper levels are visited by most descents.
+    // Past the memory budget new listings are read again by every descent
+    // that needs them instead.
+    struct dir_info
+    {
+        uint64_t entries = 0, files = 0, bytes = 0;
+        std::vector<std::string> dirs;
+        std::vector<std::unique_ptr<dir_info>> kids;  // parallel to dirs
+        size_t cost = sizeof(dir_info);
+    };
+
+    struct sum
+    {
+        double n = 0, mean = 0, m2 = 0;   // Welford
+
+        void add(double x)
+        {
+            ++n;
+            double d = x - mean;
+            mean += d / n;
+            m2 += d * (x - mean);
+        }
+        // Half width of the 95% confidence interval of the mean.
+        double margin() const
+        {
+            return n > 1 ? 1.96 * std::sqrt(m2 / (n - 1) / n) : 0;
+        }
+    };
+
+    bool show_hidden;
+    std::mt19937_64 rng{ std::random_device{}() };
+    size_t cached = 0;
+
+    std::unique_ptr<dir_info> list(const std::string& path)
+    {
+        auto info = std::make_unique<dir_info>();
+        auto dir = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        for (auto it = dir.begin(!show_hidden); it != dir.end(); ++it)
+        {
+            auto f = *it;
+            ++info->entries;
+            if (f.error()) continue;
+            if (f.is_dir())
+            {
+                info->dirs.push_back(f.name);
+                info->cost += sizeof(std::string) + f.name.size()
+                            + sizeof(std::unique_ptr<dir_info>);
+            }
+            if (S_ISREG(f.st.st_mode))
+                ++info->files, info->bytes += f.st.st_size;
+        }
+        info->kids.resize(info->dirs.size());
+        return info;
+    }
+
+public:
+    estimator(bool show_hidden) : show_hidden(show_hidden) {}
+    ~estimator() { Memory.release(cached); }
+
+    estimator(const estimator&) = delete;
+    estimator& operator=(const estimator&) = delete;
+
+    void run(const char* root, double seconds, std::ostream& out)
+    {
+        using clock = std::chrono::steady_clock;
+        auto deadline = clock::now() + std::chrono::duration<double>(seconds);
+
+        auto top = list(root);
+        Memory.force(top->cost);
+        cached += top->cost;
+        std::vector<std::unique_ptr<dir_info>> scratch;
+        sum entries, files, bytes;
+        std::vector<sum> depths;    // entries per depth, from depth 1
+        uint64_t descents = 0;
+
+        do
+        {
+            std::vector<double> at_depth;
+            double w = 1, e = 1, f = 0, b = 0;
+            std::string path = root;
+            bool keep = true;
+            scratch.clear();
+            for (dir_info* d = top.get(); ; )
+            {
+                e += w * d->entries;
+                f += w * d->files;
+                b += w * d->bytes;
+                at_depth.push_back(w * d->entries);
+                if (d->dirs.empty()) break;
+
+                size_t i = rng() % d->dirs.size();
+                w *= d->dirs.size();
+                if (path.back() != '/') path += '/';
+                path += d->dirs[i];
+                if (!d->kids[i])
+                {
+                    auto l = list(path);
+                    keep = keep && Memory.try_reserve(l->cost);
+                    if (!keep)
+                    {
+                        scratch.push_back(std::move(l));
+                        d = scratch.back().get();
+                        continue;
+                    }
+                    cached += l->cost;
+                    d->kids[i] = std::move(l);
+                }
+                d = d->kids[i].get();
+            }
+
+            entries.add(e), files.add(f), bytes.add(b);
+            if (depths.size() < at_depth.size())
+                depths.resize(at_depth.size());
+            // Descents that end early count zero entries further down.
+            for (size_t i = 0; i < depths.size(); ++i)
+            {
+                while (depths[i].n < descents) depths[i].add(0);
+                depths[i].add(i < at_depth.size() ? at_depth[i] : 0);
+            }
+            ++descents;
+        } while (clock::now() < deadline);
+
+        auto line = [&](const char* what, const sum& s)
+        {
+            out << "  " << what << " " << uint64_t(s.mean + 0.5)
+                << " ± " << uint64_t(s.margin() + 0.5) << "\n";
+        };
+        out << root << ": " << descents << " descents, 95% confidence\n";
+        line("entries", entries);
+        line("files  ", files);
+        line("bytes  ", bytes);
+        out << "  depth  entries\n";
+        for (size_t i = 0; i < depths.size(); ++i)
+        {
+            while (depths[i].n < descents) depths[i].add(0);
+            out << "  " << std::setw(5) << i + 1 << "  "
+                << uint64_t(depths[i].mean + 0.5) << " ± "
+                << uint64_t(depths[i].margin() + 0.5) << "\n";
+        }
+    }
+};
+
+// Entries and bytes per owning user and group, for each root and for each
+// directory right under it.
+class owner_report
+{
+    struct usage
+    {
+        uint64_t entries = 0;
+        uint64_t bytes = 0;     // of regular files
+    };
+
+    // Few distinct ids occur in a tree, a vector searched from the last
+    // hit beats hashing.
+    struct usage_map
+    {
+        std::vector<std::pair<uint32_t, usage>> ids;
+        size_t last = 0;
+
+        usage& operator[](uint32_t id)
+        {
+            if (last < ids.size() && ids[last].first == id)
+                return ids[last].second;
+            for (last = 0; last < ids.size(); ++last)
+                if (ids[last].first == id)
+                    return ids[last].second;
+            ids.push_back({ id, {} });
+            return ids.back().second;
+        }
+
+        void merge(const usage_map& o)
+        {
+            for (auto& [id, u] : o.ids)
+            {
+                auto& t = (*this)[id];
+                t.entries += u.entries;
+                t.bytes += u.bytes;
+            }
+        }
+    };
+
+    struct totals
+    {
+        std::string path;
+        usage_map users, groups;
+    };
+
+    bool show_hidden;
+    std::vector<totals> rows;   // a root, then the directories under it
+    std::map<uint32_t, std::string> user_names, group_names;
+    error_summary errors;
+    // The rows are the result, they are counted but never dropped.
+    size_t accounted = 0;
+
+    void keep(totals t)
+    {
+        size_t cost = sizeof(totals) + t.path.size()
+            + (t.users.ids.size() + t.groups.ids.size()) * sizeof(t.users.ids[0]);
+        Memory.force(cost);
+        accounted += cost;
+        rows.push_back(std::move(t));
+    }
+
+    void walk(const file_t& f, totals& t)
+    {
+        if (f.error()) return errors.add(*f.error());
+        uint64_t bytes = S_ISREG(f.st.st_mode) ? f.st.st_size : 0;
+        auto& u = t.users[f.st.st_uid];
+        ++u.entries, u.bytes += bytes;
+        auto& g = t.groups[f.st.st_gid];
+        ++g.entries, g.bytes += bytes;
+
+        auto it = f.begin(!show_hidden);
+        for (; it != f.end(); ++it)
+            walk(*it, t);
+        if (it.error()) errors.add(*it.error());
+    }
+
+    const std::string& user_name(uint32_t uid)
+    {
+        auto [it, added] = user_names.emplace(uid, std::string());
+        if (added)
+        {
+            auto pw = ::getpwuid(uid);
+            it->second = pw ? pw->pw_name : std::to_string(uid);
+        }
+        return it->second;
+    }
+
+    const std::string& group_name(uint32_t gid)
+    {
+        auto [it, added] = group_names.emplace(gid, std::string());
+        if (added)
+        {
+            auto gr = ::getgrgid(gid);
+            it->second = gr ? gr->gr_name : std::to_string(gid);
+        }
+        return it->second;
+    }
+
+    template<typename Name>
+    void section(std::ostream& out, const char* what,
+                 usage_map totals::* map, Name name)
+    {
+        out << std::left << std::setw(12) << what << std::right
+            << std::setw(10) << "entries" << std::setw(16) << "bytes"
+            << "  path\n";
+        for (auto& t : rows)
+        {
+            auto ids = (t.*map).ids;
+            std::sort(ids.begin(), ids.end(), [](auto& a, auto& b)
+            {
+                return a.second.bytes > b.second.bytes;
+            });
+            for (auto& [id, u] : ids)
+                out << std::left << std::setw(12) << name(id) << std::right
+                    << std::setw(10) << u.entries << std::setw(16) << u.bytes
+                    << "  " << t.path << "\n";
+        }
+    }
+
+public:
+    owner_report(bool show_hidden) : show_hidden(show_hidden) {}
+    ~owner_report() { Memory.release(accounted); }
+
+    owner_report(const owner_report&) = delete;
+    owner_report& operator=(const owner_report&) = delete;
+
+    void add_root(std::string path)
+    {
+        auto root = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        size_t first = rows.size();
+        keep({ path, {}, {} });
+        if (root.error()) return errors.add(*root.error());
+
+        // The root's own entries and files, the directories under it get
+        // rows of their own and are added to the root's at the end.
+        totals top{ path, {}, {} };
+        auto& u = top.users[root.st.st_uid];
+        auto& g = top.groups[root.st.st_gid];
+        ++u.entries, ++g.entries;
+        size_t len = path.size();
+        auto it = root.begin(!show_hidden);
+        for (; it != root.end(); ++it)
+        {
+            auto f = *it;
+            if (!f.is_dir())
+            {
+                walk(f, top);
+                continue;
+            }
+            if (path.back() != '/') path += '/';
+            path += *it.d_name;
+            totals sub{ path, {}, {} };
+            walk(f, sub);
+            keep(std::move(sub));
+            path.resize(len);
+        }
+        if (it.error()) errors.add(*it.error());
+
+        rows[first].users.merge(top.users);
+        rows[first].groups.merge(top.groups);
+        for (size_t i = first + 1; i < rows.size(); ++i)
+        {
+            rows[first].users.merge(rows[i].users);
+            rows[first].groups.merge(rows[i].groups);
+        }
+    }
+
+    void print(std::ostream& out)
+    {
+        section(out, "user", &totals::users,
+                [&](uint32_t id) -> auto& { return user_name(id); });
+        out << "\n";
+        section(out, "group", &totals::groups,
+                [&](uint32_t id) -> auto& { return group_name(id); });
+        errors.print(out);
+    }
+
+    bool failed() const noexcept { return !errors.empty(); }
+};
+
+// Allocation efficiency from the stat of every regular file: st_blocks
+// counts 512-byte units actually allocated, so a file allocating less than
+// its size is sparse, and allocation beyond the size is waste.
+class allocation_report
+{
+    // Files below this size allocating four times their size or more are
+    // counted as over-allocated.
+    static constexpr uint64_t small_size = 64 * 1024;
+
+    struct dir_waste
+    {
+        std::string path;
+        uint64_t waste = 0;
+        uint64_t small = 0;
+    };
+
+    struct sparse_file
+    {
+        std::string path;
+        uint64_t size, allocated;
+    };
+
+    bool show_hidden;
+    std::vector<dir_waste> dirs;
+    std::vector<sparse_file> sparse;
+    uint64_t size = 0, allocated = 0, waste = 0, files = 0;
+    error_summary errors;
+    // The listed paths are the result, they are counted but never dropped.
+    size_t accounted = 0;
+
+    void count(const std::string& path, size_t n)
+    {
+        Memory.force(n + path.size());
+        accounted += n + path.size();
+    }
+
+    void walk(const file_t& f, std::string& path)
+    {
+        dir_waste here{ path };
+        size_t len = path.size();
+        auto it = f.begin(!show_hidden);
+        for (; it != f.end(); ++it)
+        {
+            if (path.back() != '/') path += '/';
+            path += *it.d_name;
+            auto e = *it;
+            if (e.error())
+                errors.add(*e.error());
+            else if (e.is_dir())
+                walk(e, path);
+            else if (S_ISREG(e.st.st_mode))
+            {
+                uint64_t s = e.st.st_size;
+                uint64_t a = uint64_t(e.st.st_blocks) * 512;
+                ++files, size += s, allocated += a;
+                if (a < s)
+                {
+                    count(path, sizeof(sparse_file));
+                    sparse.push_back({ path, s, a });
+                }
+                else
+                {
+                    here.waste += a - s;
+                    // Empty files and data inlined in the inode allocate
+                    // nothing of their own.
+                    if (s > 0 && s < small_size && a > s && a >= 4 * s)
+                        ++here.small;
+                }
+            }
+            path.resize(len);
+        }
+        if (it.error()) errors.add(*it.error());
+        waste += here.waste;
+        if (here.waste)
+        {
+            count(here.path, sizeof(dir_waste));
+            dirs.push_back(std::move(here));
+        }
+    }
+
+public:
+    allocation_report(bool show_hidden) : show_hidden(show_hidden) {}
+    ~allocation_report() { Memory.release(accounted); }
+
+    allocation_report(const allocation_report&) = delete;
+    allocation_report& operator=(const allocation_report&) = delete;
+
+    void add_root(std::string path)
+    {
+        auto root = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        if (root.error())
+            errors.add(*root.error());
+        else if (root.is_dir())
+            walk(root, path);
+    }
+
+    void print(std::ostream& out)
+    {
+        auto sizes = [&](uint64_t a, uint64_t b)
+        {
+            out << std::setw(16) << a << std::setw(16) << b << "  ";
+        };
+
+        std::sort(sparse.begin(), sparse.end(), [](auto& a, auto& b)
+        {
+            return a.size - a.allocated > b.size - b.allocated;
+        });
+        out << "sparse files\n" << std::setw(16) << "size"
+            << std::setw(16) << "allocated" << "  path\n";
+        for (auto& s : sparse)
+            sizes(s.size, s.allocated), out << s.path << "\n";
+
+        std::sort(dirs.begin(), dirs.end(), [](auto& a, auto& b)
+        {
+            return a.waste > b.waste;
+        });
+        out << "\nwaste by directory, small files allocating 4x their size\n"
+            << std::setw(16) << "waste" << std::setw(16) << "small files"
+            << "  path\n";
+        for (auto& d : dirs)
+            sizes(d.waste, d.small), out << d.path << "\n";
+
+        out << "\n" << files << " files, " << size << " bytes, "
+            << allocated << " allocated, " << waste << " wasted, "
+            << sparse.size() << " sparse\n";
+        errors.print(out);
+    }
+
+    bool failed() const noexcept { return !errors.empty(); }
+};
+
+// Fragmentation from the number of extents FS_IOC_FIEMAP reports for each
+// file of at least min_size. The walk queues the files, a fixed set of
+// workers opens them and asks for the extent count only, and the counts
+// are summed per directory.
+class fragmentation_report
+{
+    struct dir_extents
+    {
+        std::string path;
+        uint64_t files = 0;
+        uint64_t extents = 0;
+        uint64_t failed = 0;
+        uint64_t most = 0;
+        std::string most_path = {};
+    };
+
+    struct job
+    {
+        size_t dir;
+        std::string path;
+    };
+
+    bool show_hidden;
+    uint64_t min_size;
+    std::vector<dir_extents> dirs;
+    error_summary errors;   // of the walk, unmappable files are counted apart
+
+    // Bounded, so the walk waits for the workers instead of queueing the
+    // whole tree, and shorter once over the memory budget.
+    static constexpr size_t queue_limit = 1024;
+    static constexpr size_t queue_limit_over = 16;
+    size_t accounted = 0;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<job> queue;
+    bool done = false;
+    std::vector<std::thread> workers;
+
+    static std::optional<uint32_t> extent_count(const char* path) noexcept
+    {
+        // The file was regular when walked but may have been replaced since,
+        // a fifo must not block the open and only a regular file is mapped.
+        fd_t fd = ::open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (fd.fd == -1) return std::nullopt;
+        struct stat st;
+        if (::fstat(fd.fd, &st) == -1 || !S_ISREG(st.st_mode))
+            return std::nullopt;
+        ::fiemap fm = {};
+        // No FIEMAP_FLAG_SYNC: a report must not write back dirty pages,
+        // extents still under delayed allocation are simply not counted.
+        fm.fm_length = FIEMAP_MAX_OFFSET;
+        if (::ioctl(fd.fd, FS_IOC_FIEMAP, &fm) == -1) return std::nullopt;
+        return fm.fm_mapped_extents;
+    }
+
+    void work()
+    {
+        std::unique_lock guard(lock);
+        for (;;)
+        {
+            changed.wait(guard, [&] { return !queue.empty() || done; });
+            if (queue.empty()) return;
+            auto j = std::move(queue.back());
+            queue.pop_back();
+            changed.notify_all();
+
+            guard.unlock();
+            auto n = extent_count(j.path.c_str());
+            guard.lock();
+
+            auto& d = dirs[j.dir];
+            if (!n)
+            {
+                ++d.failed;
+                continue;
+            }
+            ++d.files, d.extents += *n;
+            if (*n > d.most)
+                d.most = *n, d.most_path = std::move(j.path);
+        }
+    }
+
+    void walk(const file_t& f, std::string& path)
+    {
+        size_t here = dirs.size();
+        {
+            std::lock_guard guard(lock);
+            dirs.push_back({ path });
+            accounted += sizeof(dir_extents) + path.size();
+            Memory.force(sizeof(dir_extents) + path.size());
+        }
+        size_t len = path.size();
+        auto it = f.begin(!show_hidden);
+        for (; it != f.end(); ++it)
+        {
+            if (path.back() != '/') path += '/';
+            path += *it.d_name;
+            auto e = *it;
+            if (e.error())
+                errors.add(*e.error());
+            else if (e.is_dir())
+                walk(e, path);
+            else if (S_ISREG(e.st.st_mode)
+                     && uint64_t(e.st.st_size) >= min_size)
+            {
+                std::unique_lock guard(lock);
+                changed.wait(guard, [&]
+                {
+                    return queue.size() < (Memory.over() ? queue_limit_over
+                                                          : queue_limit);
+                });
+                queue.push_back({ here, path });
+                changed.notify_all();
+            }
+            path.resize(len);
+        }
+        if (it.error()) errors.add(*it.error());
+    }
+
+public:
+    fragmentation_report(bool show_hidden, uint64_t min_size)
+        : show_hidden(show_hidden), min_size(min_size)
+    {
+        unsigned n = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+        for (unsigned i = 0; i < n; ++i)
+            workers.emplace_back([this] { work(); });
+    }
+
+    ~fragmentation_report()
+    {
+        finish();
+        Memory.release(accounted);
+    }
+
+    void add_root(std::string path)
+    {
+        auto root = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        if (root.error())
+            errors.add(*root.error());
+        else if (root.is_dir())
+            walk(root, path);
+    }
+
+    void finish()
+    {
+        {
+            std::lock_guard guard(lock);
+            done = true;
+            changed.notify_all();
+        }
+        for (auto& w : workers)
+            w.join();
+        workers.clear();
+    }
+
+    void print(std::ostream& out)
+    {
+        finish();
+        std::erase_if(dirs, [](auto& d) { return !d.files && !d.failed; });
+        std::sort(dirs.begin(), dirs.end(), [](auto& a, auto& b)
+        {
+            return a.extents * std::max<uint64_t>(b.files, 1)
+                 > b.extents * std::max<uint64_t>(a.files, 1);
+        });
+
+        uint64_t files = 0, extents = 0, failed = 0;
+        out << std::setw(8) << "files" << std::setw(10) << "extents"
+            << std::setw(10) << "average" << std::setw(8) << "most"
+            << "  path\n";
+        for (auto& d : dirs)
+        {
+            files += d.files, extents += d.extents, failed += d.failed;
+            if (!d.files) continue;
+            out << std::setw(8) << d.files << std::setw(10) << d.extents
+                << std::setw(10) << std::fixed << std::setprecision(1)
+                << double(d.extents) / d.files << std::setw(8) << d.most
+                << "  " << d.path << "\n";
+            if (d.most > 1)
+                out << std::setw(36) << "" << "most in " << d.most_path << "\n";
+        }
+        out << "\n" << files << " files of " << min_size << " bytes or more, "
+            << extents << " extents";
+        if (failed) out << ", " << failed << " could not be mapped";
+        out << "\n";
+        errors.print(out);
+    }
+
+    bool failed() const noexcept { return !errors.empty(); }
+};
+
+// Names of one directory that differ only by case or by Unicode
+// normalization, which collide on case-insensitive or normalizing
+// filesystems. Each name is reduced to its collision_key: ASCII names are
+// lowercased, others are decoded, decomposed and case-folded codepoint by
+// codepoint.
+class collision_finder
+{
+    bool show_hidden;
+    uint64_t groups = 0;
+    error_summary errors;
+
+    void report(std::ostream& out, const std::string& path,
+                const std::vector<std::string>& names)
+    {
+        ++groups;
+        // Names equal once decomposed differ by normalization, distinct
+        // decomposed names by case.
+        std::vector<std::string> forms;
+        for (auto& n : names)
+            forms.push_back(collision_key(n, false));
+        std::sort(forms.begin(), forms.end());
+        size_t distinct = std::unique(forms.begin(), forms.end()) - forms.begin();
+        bool by_case = distinct > 1, by_form = distinct < names.size();
+
+        out << path << ":";
+        for (auto& n : names)
+            out << " '" << n << "'";
+        out << " (" << (by_case ? "case" : "")
+            << (by_case && by_form ? ", " : "")
+            << (by_form ? "normalization" : "") << ")\n";
+    }
+
+    void walk(const file_t& f, std::string& path, std::ostream& out)
+    {
+        // Kept while the subdirectories are walked, counted but not bounded.
+        std::unordered_map<std::string, std::vector<std::string>> seen;
+        size_t accounted = 0;
+        size_t len = path.size();
+        auto it = f.begin(!show_hidden);
+        for (; it != f.end(); ++it)
+        {
+            size_t cost = 64 + 2 * it.d_name->size();
+            Memory.force(cost);
+            accounted += cost;
+            seen[collision_key(*it.d_name, true)].push_back(*it.d_name);
+            auto e = *it;
+            if (e.error()) errors.add(*e.error());
+            if (!e.is_dir()) continue;
+            if (path.back() != '/') path += '/';
+            path += *it.d_name;
+            walk(e, path, out);
+            path.resize(len);
+        }
+        if (it.error()) errors.add(*it.error());
+
+        for (auto& [k, names] : seen)
+            if (names.size() > 1)
+                report(out, path, names);
+        Memory.release(accounted);
+    }
+
+public:
+    collision_finder(bool show_hidden) : show_hidden(show_hidden) {}
+
+    collision_finder(const collision_finder&) = delete;
+    collision_finder& operator=(const collision_finder&) = delete;
+
+    void add_root(std::string path, std::ostream& out)
+    {
+        auto root = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        if (root.error())
+            errors.add(*root.error());
+        else if (root.is_dir())
+            walk(root, path, out);
+    }
+
+    void print_errors(std::ostream& out) const { errors.print(out); }
+
+    uint64_t found() const noexcept { return groups; }
+    bool failed() const noexcept { return !errors.empty(); }
+};
+
+// Git status of the walked entries, read from .git/index rather than by
+// running git: an entry is tracked when the index lists it, modified when
+// its stat differs from the one the index cached, ignored when a
+// .gitignore rule matches it, and untracked otherwise. Directories are
+// tracked when they hold a tracked entry. Content is never hashed, so an
+// entry whose stat changed but whose content did not shows as modified,
+// and so does a racily clean one: cached no earlier than the second the
+// index was written, it may have changed again within that second.
+class git_status
+{
+public:
+    enum class state : uint8_t { none, tracked, modified, untracked, ignored };
+
+private:
+    // The fields git compares by default, truncated to 32 bits as cached.
+    struct cached_stat
+    {
+        uint32_t ctime_sec, ctime_nsec, mtime_sec, mtime_nsec;
+        uint32_t ino, mode, uid, gid, size;
+    };
+
+    struct rule
+    {
+        std::string pattern;
+        bool negate = false;
+        bool dir_only = false;
+        bool anchored = false;  // matched against the path, not the name
+    };
+
+    std::unordered_map<std::string, cached_stat> files;
+    std::unordered_set<std::string> dirs;   // hold tracked entries
+    uint32_t index_mtime = 0;   // seconds, of the index file itself
+    // Rules of each directory that has any, by path relative to the top,
+    // read as the walk enters the directory.
+    std::unordered_map<std::string, std::vector<rule>> rules;
+
+    static uint32_t be32(const char* p) noexcept
+    {
+        auto b = reinterpret_cast<const uint8_t*>(p);
+        return uint32_t(b[0]) << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    }
+
+    static std::vector<rule> read_rules(const std::string& file)
+    {
+        std::vector<rule> r;
+        std::ifstream in(file);
+        for (std::string line; std::getline(in, line); )
+        {
+            while (!line.empty() && (line.back() == ' ' || line.back() == '\r'))
+                line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            rule x;
+            if (line[0] == '!') x.negate = true, line.erase(0, 1);
+            else if (line[0] == '\\') line.erase(0, 1);
+            if (line.size() > 1 && line.back() == '/')
+                x.dir_only = true, line.pop_back();
+            x.anchored = line.find('/') != line.npos;
+            if (line[0] == '/') line.erase(0, 1);
+            x.pattern = line;
+            r.push_back(std::move(x));
+        }
+        return r;
+    }
+
+    static bool matches(const rule& r, const std::string& path,
+                        std::string_view name, bool is_dir)
+    {
+        if (r.dir_only && !is_dir) return false;
+        if (!r.anchored)
+            return ::fnmatch(r.pattern.c_str(), std::string(name).c_str(), 0) == 0;
+        if (r.pattern.find("**") == r.pattern.npos)
+            return ::fnmatch(r.pattern.c_str(), path.c_str(), FNM_PATHNAME) == 0;
+        // Without FNM_PATHNAME '*' also matches '/', close enough to '**'.
+        if (r.pattern.starts_with("**/")
+            && ::fnmatch(r.pattern.c_str() + 3, path.c_str(), 0) == 0)
+            return true;
+        return ::fnmatch(r.pattern.c_str(), path.c_str(), 0) == 0;
+    }
+
+public:
+    // Path of the work tree root, and of the walked root relative to it.
+    std::string top;
+    std::string prefix;
+
+    maybe_err load(const char* root)
+    {
+        char buf[PATH_MAX];
+        if (!::realpath(root, buf))
+            return err_t::last(op_t::open);
+        std::string at = buf;
+
+        // The nearest enclosing directory with a .git, a directory or a
+        // "gitdir: " file as in worktrees and submodules.
+        std::string git;
+        for (;;)
+        {
+            struct stat st;
+            auto dot = (at == "/" ? "" : at) + "/.git";
+            if (::stat(dot.c_str(), &st) == 0)
+            {
+                git = dot;
+                if (!S_ISDIR(st.st_mode))
+                {
+                    std::ifstream in(dot);
+                    std::string line;
+                    std::getline(in, line);
+                    if (!line.starts_with("gitdir: "))
+                        return err_t{ EINVAL, op_t::open };
+                    git = line.substr(8);
+                    if (git[0] != '/') git = at + "/" + git;
+                }
+                break;
+            }
+            if (at == "/")
+                return err_t{ ENOENT, op_t::open };
+            at.resize(std::max<size_t>(at.rfind('/'), 1));
+        }
+        top = at;
+        // The path of buf under top, whose own slash ends top when it is "/".
+        size_t skip = top == "/" ? 1 : top.size() + 1;
+        prefix = std::string(buf).substr(std::min(skip, std::strlen(buf)));
+
+        rules[""] = read_rules(git + "/info/exclude");
+
+        fd_t fd = ::open((git + "/index").c_str(), O_RDONLY);
+        if (fd.fd == -1)
+            return errno == ENOENT ? maybe_err{} : err_t::last(op_t::open);
+        struct stat st;
+        if (::fstat(fd.fd, &st) == -1)
+            return err_t::last(op_t::fstat);
+        if (st.st_size < 12)
+            return err_t{ EINVAL, op_t::open };
+        index_mtime = st.st_mtim.tv_sec;
+        void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.fd, 0);
+        if (map == MAP_FAILED)
+            return err_t::last(op_t::mmap);
+        auto err = parse(static_cast<const char*>(map), st.st_size);
+        ::munmap(map, st.st_size);
+        return err;
+    }
+
+    // Entries of index versions 2 to 4, the extensions that follow them
+    // are not needed.
+    maybe_err parse(const char* p, size_t size)
+    {
+        const char* end = p + size;
+        uint32_t version = be32(p + 4), count = be32(p + 8);
+        if (std::memcmp(p, "DIRC", 4) != 0 || version < 2 || version > 4)
+            return err_t{ EINVAL, op_t::open };
+
+        std::string name;
+        const char* e = p + 12;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            const char* start = e;
+            if (end - e < 62) return err_t{ EINVAL, op_t::open };
+            cached_stat s{ be32(e), be32(e + 4), be32(e + 8), be32(e + 12),
+                           be32(e + 20), be32(e + 24), be32(e + 28),
+                           be32(e + 32), be32(e + 36) };
+            uint16_t flags = uint8_t(e[60]) << 8 | uint8_t(e[61]);
+            e += 62;
+            if (version >= 3 && (flags & 0x4000))
+            {
+                if (end - e < 2) return err_t{ EINVAL, op_t::open };
+                e += 2;
+            }
+
+            if (version == 4)
+            {
+                // Drops that many bytes of the previous name, offset varint.
+                if (e == end) return err_t{ EINVAL, op_t::open };
+                uint64_t drop = uint8_t(*e) & 0x7f;
+                while (uint8_t(*e++) & 0x80)
+                {
+                    if (e == end) return err_t{ EINVAL, op_t::open };
+                    drop = ((drop + 1) << 7) | (uint8_t(*e) & 0x7f);
+                }
+                name.resize(name.size() - std::min<uint64_t>(drop, name.size()));
+            }
+            else
+                name.clear();
+            auto nul = static_cast<const char*>(std::memchr(e, 0, end - e));
+            if (!nul) return err_t{ EINVAL, op_t::open };
+            name.append(e, nul);
+            e = nul + 1;
+            if (version < 4)
+                e = start + ((e - start + 7) & ~size_t(7));
+
+            files.emplace(name, s);
+            for (size_t slash = name.rfind('/'); slash != name.npos && slash;
+                 slash = name.rfind('/', slash - 1))
+                if (!dirs.emplace(name.substr(0, slash)).second)
+                    break;
+        }
+        return {};
+    }
+
+    // rel is relative to the top, path is where the directory is found.
+    void enter(const std::string& rel, const std::string& path)
+    {
+        auto r = read_rules(path + "/.gitignore");
+        if (!r.empty())
+            rules[rel].insert(rules[rel].end(), r.begin(), r.end());
+    }
+
+    state of(const std::string& rel, std::string_view name,
+             const file_t& f, bool parent_ignored) const
+    {
+        if (f.error() || rel.empty()) return state::none;
+        if (name == ".git" || rel.starts_with(".git/")
+            || rel.find("/.git/") != rel.npos)
+            return state::none;
+        if (f.is_dir())
+        {
+            if (dirs.count(rel) || files.count(rel)) return state::tracked;
+        }
+        else if (auto it = files.find(rel); it != files.end())
+        {
+            // The permission bits are left out, the index only keeps the
+            // executable bit and core.fileMode may say to ignore it.
+            auto& s = it->second;
+            bool same = s.ctime_sec == uint32_t(f.st.st_ctim.tv_sec)
+                     && s.ctime_nsec == uint32_t(f.st.st_ctim.tv_nsec)
+                     && s.mtime_sec == uint32_t(f.st.st_mtim.tv_sec)
+                     && s.mtime_nsec == uint32_t(f.st.st_mtim.tv_nsec)
+                     && s.ino == uint32_t(f.st.st_ino)
+                     && (s.mode & S_IFMT) == (f.st.st_mode & S_IFMT)
+                     && s.uid == f.st.st_uid && s.gid == f.st.st_gid
+                     && s.size == uint32_t(f.st.st_size);
+            bool racy = s.mtime_sec >= index_mtime;
+            return same && !racy ? state::tracked : state::modified;
+        }
+        if (parent_ignored) return state::ignored;
+
+        // The last matching rule wins, from the top down.
+        bool ignored = false;
+        auto check = [&](const std::string& dir)
+        {
+            auto it = rules.find(dir);
+            if (it == rules.end()) return;
+            auto sub = dir.empty() ? rel : rel.substr(dir.size() + 1);
+            for (auto& r : it->second)
+                if (matches(r, sub, name, f.is_dir()))
+                    ignored = !r.negate;
+        };
+        check("");
+        for (size_t slash = rel.find('/'); slash != rel.npos;
+             slash = rel.find('/', slash + 1))
+            check(rel.substr(0, slash));
+        return ignored ? state::ignored : state::untracked;
+    }
+
+    struct node;
+
+    struct iter
+    {
+        git_status* git = nullptr;
+        iter_t it;
+        const std::string* rel = nullptr;
+        const std::string* path = nullptr;
+        bool ignored = false;
+
+        const maybe_err& error() const noexcept { return it.error(); }
+        bool is_last() const noexcept { return it.is_last(); }
+        node operator*() const;
+        iter& operator++() noexcept { ++it; return *this; }
+
+        friend bool operator==(const iter& a, const iter& b) noexcept
+        {
+            return a.it == b.it;
+        }
+    };
+
+    struct node
+    {
+        git_status* git;
+        file_t f;
+        std::string rel;
+        std::string path;
+        state s;
+
+        iter begin(bool skip_hidden = false) const
+        {
+            if (f.is_dir()) git->enter(rel, path);
+            return { git, f.begin(skip_hidden), &rel, &path,
+                     s == state::ignored };
+        }
+        iter end() const { return { git, f.end() }; }
+
+        friend std::ostream& operator<<(std::ostream& o, const node& n)
+        {
+            o << n.f;
+            switch (n.s)
+            {
+                case state::none:      break;
+                case state::tracked:   o << " [tracked]"; break;
+                case state::modified:  o << " [modified]"; break;
+                case state::untracked: o << " [untracked]"; break;
+                case state::ignored:   o << " [ignored]"; break;
+            }
+            return o;
+        }
+    };
+
+    node root(const char* path)
+    {
+        // The rules of the directories above the root apply to it too.
+        if (!prefix.empty())
+            enter("", top);
+        for (size_t slash = prefix.find('/'); slash != prefix.npos;
+             slash = prefix.find('/', slash + 1))
+            enter(prefix.substr(0, slash), top + "/" + prefix.substr(0, slash));
+
+        auto f = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        auto s = of(prefix, prefix.substr(prefix.rfind('/') + 1), f, false);
+        return { this, std::move(f), prefix, path, s };
+    }
+};
+
+git_status::node git_status::iter::operator*() const
+{
+    const auto& name = *it.d_name;
+    auto child_rel = rel->empty() ? name : *rel + "/" + name;
+    auto child_path = *path + (path->back() == '/' ? "" : "/") + name;
+    auto f = *it;
+    auto s = git->of(child_rel, name, f, ignored);
+    return { git, std::move(f), std::move(child_rel), std::move(child_path), s };
+}
+
+// Walk over io_uring: every directory visit is a coroutine that suspends on
+// its openat, statx and close requests, and one loop submits the requests
+// and resumes the visits as they complete, so thousands of them can be in
+// flight on one thread. io_uring has no request for reading a directory,
+// the listing itself is a getdents64 call. The tree is collected in memory
+// and printed once complete.
+//
+// Under --max-memory the collected tree is counted but never refused, it
+// only makes the walk keep fewer directories open, so the limit does not
+// bound it. The statx buffers and the visit frames are counted as well,
+// and a visit that is refused memory stats fewer entries at a time.
+
+// The rings mapped as io_uring_setup lays them out.
+class uring
+{
+    int fd = -1;
+    void* sq_ptr = MAP_FAILED;
+    void* cq_ptr = MAP_FAILED;
+    void* sqes_ptr = MAP_FAILED;
+    size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    ::io_uring_sqe* sqes = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    ::io_uring_cqe* cqes = nullptr;
+
+    // Tail of the filled entries, published to the kernel by submit().
+    unsigned sqe_tail = 0;
+    unsigned queued = 0;
+
+public:
+    unsigned sq_size = 0, cq_size = 0;
+
+    uring() = default;
+    uring(const uring&) = delete;
+    uring& operator=(const uring&) = delete;
+
+    ~uring()
+    {
+        if (sqes_ptr != MAP_FAILED) ::munmap(sqes_ptr, sqes_len);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) ::munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) ::munmap(sq_ptr, sq_len);
+        if (fd != -1) ::close(fd);
+    }
+
+    maybe_err init(unsigned entries) noexcept
+    {
+        ::io_uring_params p = {};
+        fd = ::syscall(SYS_io_uring_setup, entries, &p);
+        if (fd == -1)
+            return err_t::last(op_t::uring);
+
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(::io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        sq_ptr = ::mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+            return err_t::last(op_t::mmap);
+        cq_ptr = p.features & IORING_FEAT_SINGLE_MMAP ? sq_ptr
+            : ::mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return err_t::last(op_t::mmap);
+        sqes_len = p.sq_entries * sizeof(::io_uring_sqe);
+        sqes_ptr = ::mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED)
+            return err_t::last(op_t::mmap);
+
+        auto sq = static_cast<char*>(sq_ptr);
+        auto cq = static_cast<char*>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqes = static_cast<::io_uring_sqe*>(sqes_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<::io_uring_cqe*>(cq + p.cq_off.cqes);
+        sq_size = p.sq_entries;
+        cq_size = p.cq_entries;
+        sqe_tail = *sq_tail;
+        return {};
+    }
+
+    // Next free submission entry, cleared, or null when the ring is full.
+    // The kernel sees it once submit() publishes the tail.
+    ::io_uring_sqe* get_sqe() noexcept
+    {
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_size)
+            return nullptr;
+        unsigned i = sqe_tail++ & sq_mask;
+        sq_array[i] = i;
+        ++queued;
+        std::memset(&sqes[i], 0, sizeof(sqes[i]));
+        return &sqes[i];
+    }
+
+    // Submits the queued entries, waiting for a completion when asked to.
+    maybe_err submit(bool wait) noexcept
+    {
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        while (queued || wait)
+        {
+            int n = ::syscall(SYS_io_uring_enter, fd, queued, wait ? 1 : 0,
+                              flags, nullptr, 0);
+            if (n == -1)
+            {
+                if (errno == EINTR) continue;
+                return err_t::last(op_t::uring);
+            }
+            queued -= n;
+            wait = false;
+        }
+        return {};
+    }
+
+    template<typename F>
+    void reap(F on_complete)
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+            on_complete(cqes[head & cq_mask]);
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+};
+
+class uring_walker
+{
+public:
+    struct entry
+    {
+        std::string name;
+        maybe_err err = {};     // of its statx
+        maybe_err dir_err = {}; // of opening or reading it
+        bool is_dir = false;
+        std::vector<entry> kids = {};
+    };
+
+private:
+    // Requests a suspended visit waits for, it is resumed once left is 0.
+    struct waiter
+    {
+        unsigned left = 0;
+        std::coroutine_handle<> h;
+    };
+
+    struct request
+    {
+        uint8_t opcode;
+        int fd;
+        const char* path = nullptr;
+        int flags = 0;
+        struct statx* stx = nullptr;
+        waiter* w = nullptr;
+        int res = 0;
+    };
+
+    // Awaits all of reqs.
+    struct submit_all
+    {
+        uring_walker* walker;
+        std::vector<request>& reqs;
+        waiter w;
+
+        bool await_ready() const noexcept { return reqs.empty(); }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            w = { unsigned(reqs.size()), h };
+            for (auto& r : reqs)
+            {
+                r.w = &w;
+                walker->pending.push_back(&r);
+            }
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // Waits for one of max_open directory descriptors to be free. A free
+    // slot is taken right away, a waiter is handed the slot of the visit
+    // that releases it and open_dirs does not change.
+    struct open_slot
+    {
+        uring_walker* walker;
+
+        bool await_ready() noexcept
+        {
+            if (walker->open_dirs >= walker->max_open
+                || !walker->slot_waiters.empty())
+                return false;
+            ++walker->open_dirs;
+            return true;
+        }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            walker->slot_waiters.push_back(h);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct visit_task
+    {
+        struct promise_type
+        {
+            static void* operator new(size_t n)
+            {
+                Memory.force(n);
+                return ::operator new(n);
+            }
+            static void operator delete(void* p, size_t n)
+            {
+                Memory.release(n);
+                ::operator delete(p);
+            }
+
+            visit_task get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    bool show_hidden;
+    uring ring;
+    std::deque<request*> pending;
+    std::deque<std::coroutine_handle<>> ready;
+    std::deque<std::coroutine_handle<>> slot_waiters;
+    unsigned in_flight = 0;
+    unsigned open_dirs = 0;
+    // Lowered to min_open once the collected tree is over the memory
+    // budget, which slows the walk down rather than stopping it.
+    unsigned max_open = 256;
+    static constexpr unsigned min_open = 16;
+    // Entries of a directory stat'ed at a time, fewer when the memory
+    // budget refuses that many.
+    static constexpr size_t stat_batch = 128;
+    static constexpr size_t stat_cost = sizeof(struct statx) + sizeof(request);
+
+    size_t reserve_batch(size_t want)
+    {
+        for (; want > 1; want /= 2)
+            if (Memory.try_reserve(want * stat_cost))
+                return want;
+        Memory.force(stat_cost);
+        return 1;
+    }
+    size_t collected = 0;
+
+    // Passes the slot on to the first waiter, unless max_open was lowered
+    // below the directories open.
+    void release_slot()
+    {
+        if (!slot_waiters.empty() && open_dirs <= max_open)
+        {
+            ready.push_back(slot_waiters.front());
+            slot_waiters.pop_front();
+            return;
+        }
+        --open_dirs;
+    }
+
+    // Names in the directory open as fd, from getdents64.
+    maybe_err list(int fd, std::vector<entry>& kids)
+    {
+        alignas(8) char buf[32 * 1024];
+        for (;;)
+        {
+            long n = ::syscall(SYS_getdents64, fd, buf, sizeof(buf));
+            if (n == 0) return {};
+            if (n == -1) return err_t::last(op_t::readdir);
+            for (long off = 0; off < n; )
+            {
+                auto d = reinterpret_cast<::dirent64*>(buf + off);
+                off += d->d_reclen;
+                std::string_view name = d->d_name;
+                if (name == "." || name == ".."
+                    || (!show_hidden && name[0] == '.'))
+                    continue;
+                kids.push_back({ std::string(name) });
+                collected += sizeof(entry) + name.size();
+                Memory.force(sizeof(entry) + name.size());
+            }
+            if (Memory.over())
+                max_open = min_open;
+        }
+    }
+
+    // Lists path, stats its entries and starts visits of its directories
+    // with levels - 1 levels left, -1 being unlimited.
+    visit_task visit(entry* e, std::string path, int levels)
+    {
+        co_await open_slot{ this };
+
+        std::vector<request> reqs(1, { IORING_OP_OPENAT, AT_FDCWD, path.c_str(),
+                                       O_RDONLY | O_DIRECTORY | O_CLOEXEC });
+        co_await submit_all{ this, reqs, {} };
+        int fd = reqs[0].res;
+        if (fd < 0)
+        {
+            e->dir_err = err_t{ -fd, op_t::openat };
+            release_slot();
+            co_return;
+        }
+
+        e->dir_err = list(fd, e->kids);
+
+        std::vector<struct statx> stx;
+        for (size_t first = 0; first < e->kids.size(); first += stx.size())
+        {
+            stx.resize(reserve_batch(std::min(stat_batch,
+                                              e->kids.size() - first)));
+            reqs.clear();
+            for (size_t i = 0; i < stx.size(); ++i)
+                reqs.push_back({ IORING_OP_STATX, fd,
+                                 e->kids[first + i].name.c_str(),
+                                 AT_SYMLINK_NOFOLLOW, &stx[i] });
+            co_await submit_all{ this, reqs, {} };
+
+            for (size_t i = 0; i < stx.size(); ++i)
+            {
+                auto& k = e->kids[first + i];
+                if (reqs[i].res < 0)
+                    k.err = err_t{ -reqs[i].res, op_t::statx };
+                else
+                    k.is_dir = S_ISDIR(stx[i].stx_mode);
+            }
+            Memory.release(stx.size() * stat_cost);
+        }
+
+        std::vector<request> close(1, { IORING_OP_CLOSE, fd });
+        co_await submit_all{ this, close, {} };
+        release_slot();
+
+        if (levels == 1) co_return;
+        for (auto& k : e->kids)
+            if (k.is_dir)
+                visit(&k, path + (path.back() == '/' ? "" : "/") + k.name,
+                      levels == -1 ? -1 : levels - 1);
+    }
+
+    void fill()
+    {
+        while (!pending.empty() && in_flight < ring.cq_size)
+        {
+            auto sqe = ring.get_sqe();
+            if (!sqe) break;
+            auto r = pending.front();
+            pending.pop_front();
+            sqe->opcode = r->opcode;
+            sqe->fd = r->fd;
+            sqe->addr = reinterpret_cast<uint64_t>(r->path);
+            sqe->user_data = reinterpret_cast<uint64_t>(r);
+            if (r->opcode == IORING_OP_OPENAT)
+                sqe->open_flags = r->flags;
+            else if (r->opcode == IORING_OP_STATX)
+            {
+                sqe->statx_flags = r->flags;
+                sqe->len = STATX_TYPE | STATX_MODE;
+                sqe->off = reinterpret_cast<uint64_t>(r->stx);
+            }
+            ++in_flight;
+        }
+    }
+
+public:
+    uring_walker(bool show_hidden) : show_hidden(show_hidden) {}
+    ~uring_walker() { Memory.release(collected); }
+
+    uring_walker(const uring_walker&) = delete;
+    uring_walker& operator=(const uring_walker&) = delete;
+
+    maybe_err init() noexcept { return ring.init(256); }
+
+    // Collects path, with levels of directories listed, -1 for all.
+    maybe_err walk(entry& root, int levels)
+    {
+        struct statx stx;
+        if (::statx(AT_FDCWD, root.name.c_str(), AT_SYMLINK_NOFOLLOW,
+                    STATX_TYPE, &stx) == -1)
+            root.err = err_t::last(op_t::statx);
+        else if (S_ISDIR(stx.stx_mode) && levels != 0)
+        {
+            root.is_dir = true;
+            visit(&root, root.name, levels);
+        }
+
+        while (!ready.empty() || !pending.empty() || in_flight)
+        {
+            while (!ready.empty())
+            {
+                auto h = ready.front();
+                ready.pop_front();
+                h.resume();
+            }
+            fill();
+            if (auto err = ring.submit(ready.empty() && in_flight))
+                return err;
+            ring.reap([&](const ::io_uring_cqe& c)
+            {
+                auto r = reinterpret_cast<request*>(c.user_data);
+                r->res = c.res;
+                --in_flight;
+                if (--r->w->left == 0)
+                    ready.push_back(r->w->h);
+            });
+        }
+        return {};
+    }
+
+    // The collected tree as printer nodes.
+    struct node;
+
+    struct iter
+    {
+        const entry* e = nullptr;
+        size_t i = 0;
+        bool at_end = false;
+
+        const maybe_err& error() const noexcept
+        {
+            static const maybe_err none;
+            return !at_end && i == e->kids.size() ? e->dir_err : none;
+        }
+        bool is_last() const noexcept
+        {
+            return i + 1 == e->kids.size() && !e->dir_err;
+        }
+        node operator*() const noexcept { return { &e->kids[i] }; }
+        iter& operator++() noexcept { ++i; return *this; }
+
+        friend bool operator==(const iter& a, const iter& b) noexcept
+        {
+            return a.i == b.i;
+        }
+    };
+
+    struct node
+    {
+        const entry* e;
+
+        const maybe_err& error() const noexcept { return e->err; }
+
+        iter begin(bool = false) const noexcept
+        {
+            if (!e->is_dir) return end();
+            return { e, 0 };
+        }
+        iter end() const noexcept { return { e, e->kids.size(), true }; }
+
+        friend std::ostream& operator<<(std::ostream& o, const node& n)
+        {
+            o << n.e->name;
+            if (n.e->err) o << " " << *n.e->err;
+            return o;
+        }
+    };
+};
+
+void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-h] [-a] [-H] [-E] [-C] [-d depth] [--max-iops N]\n"
+                    "         [--max-dirs-per-sec N] [--idle] [--deadline MS]\n"
+                    "         [--max-memory SIZE] [--stats] [DIR...]\n"
+                    "       %s --index build [--base OLD] [--shard K/N] FILE [DIR...]\n"
+                    "       %s --index merge FILE PART...\n"
+                    "       %s --index query FILE SUBSTR\n"
+                    "       %s --estimate[=SECONDS] [DIR...]\n"
+                    "       %s --by-owner [DIR...]\n"
+                    "       %s --allocation [DIR...]\n"
+                    "       %s --fragmentation[=BYTES] [DIR...]\n"
+                    "       %s --collisions [DIR...]\n"
+                    "       %s --git [-d depth] [DIR...]\n"
+                    "       %s --uring [-a] [-d depth] [DIR...]\n"
+                    "       %s --tui [DIR...]\n"
+                    "       %s --html [DIR...]\n"
+                    "       %s --csv|--tsv [--columns LIST] [DIR...]\n"
+                    "       %s --arrow FILE [DIR...]\n"
+                    "       %s --serve SOCKET [DIR...]\n"
+                    "       %s --client SOCKET render|du|find [ARG]\n"
+                    "  -a                 show hidden files\n"
+                    "  -d depth           limit displayed depth\n"
+                    "  -H, --hardlinks    tag hardlinked files with a group id\n"
+                    "                     and list the groups after the tree\n"
+                    "  -E, --errors-only  only list entries that failed,\n"
+                    "                     followed by the summary per errno\n"
+                    "  -C, --tag-collisions  tag names that differ from an\n"
+                    "                     earlier one in their directory only\n"
+                    "                     by case or Unicode normalization,\n"
+                    "                     and list the groups after the tree\n"
+                    "  --max-iops N       at most N stats and opens per second\n"
+                    "  --max-dirs-per-sec N  at most N directories read per second\n"
+                    "  --idle             run at idle I/O and lowest CPU priority\n"
+                    "  --deadline MS      give up on a filesystem call after MS\n"
+                    "                     milliseconds, and on its device\n"
+                    "  --max-memory SIZE  count memory against SIZE bytes (K, M or\n"
+                    "                     G suffix); once over it, index grams\n"
+                    "                     spill, Arrow batches flush early and\n"
+                    "                     fewer directories are cached, queued\n"
+                    "                     or prefetched; paths and results that\n"
+                    "                     must be kept are counted, not bounded\n"
+                    "  --stats            print the peak memory use on exit\n"
+                    "  --index build      write a path index of DIRs to FILE\n"
+                    "  --base OLD         write FILE as a delta of OLD, holding only\n"
+                    "                     the directories changed since OLD\n"
+                    "                     was built; OLD must be kept\n"
+                    "  --shard K/N        only index the K-th of N disjoint parts,\n"
+                    "                     split by the names under each DIR\n"
+                    "  --index merge      combine the indexes of all parts\n"
+                    "                     into FILE, all built with or all\n"
+                    "                     without -a; a single delta is\n"
+                    "                     compacted into a full index\n"
+                    "  --index query      list the indexed paths containing\n"
+                    "                     SUBSTR, with their parent directories\n"
+                    "  --estimate[=SECONDS]  estimate the number of entries and\n"
+                    "                     bytes from random descents for\n"
+                    "                     SECONDS (5 by default)\n"
+                    "  --by-owner         sum entries and bytes per user and\n"
+                    "                     group, for DIRs and each directory\n"
+                    "                     right under them\n"
+                    "  --allocation       list sparse files and the space\n"
+                    "                     allocated beyond file sizes per\n"
+                    "                     directory\n"
+                    "  --fragmentation[=BYTES]  count the extents of files of\n"
+                    "                     BYTES (1 MiB by default) or more,\n"
+                    "                     per directory\n"
+                    "  --collisions       list names in one directory that differ\n"
+                    "                     only by case or Unicode normalization,\n"
+                    "                     exits with 2 when there are any,\n"
+                    "                     else 1 on errors\n"
+                    "  --git              tag entries as tracked, modified,\n"
+                    "                     untracked or ignored from .git/index\n"
+                    "  --uring            read the tree with io_uring, keeping\n"
+                    "                     many directories in flight at once;\n"
+                    "                     not with -H, -E or the rate limits\n"
+                    "  --tui              browse interactively, directories are\n"
+                    "                     read when expanded; arrows or hjkl,\n"
+                    "                     enter toggles, / searches, n repeats\n"
+                    "  --html             write a page that expands directories\n"
+                    "                     on click\n"
+                    "  --csv, --tsv       list every entry as a row of a table\n"
+                    "  --columns LIST     comma separated columns of the table,\n"
+                    "                     out of path,depth,type,size,mtime,mode\n"
+                    "                     and error; an unreadable directory\n"
+                    "                     gets a row of type error below it\n"
+                    "  --arrow FILE       write every entry of DIRs as a row of\n"
+                    "                     an Arrow IPC file, with a row of type\n"
+                    "                     error for unreadable directories\n"
+                    "  --serve SOCKET     keep the tree of DIRs in memory, follow\n"
+                    "                     changes and answer requests on SOCKET\n"
+                    "  --client SOCKET    ask a running --serve: render a path,\n"
+                    "                     sum its sizes or find a substring\n",
+                    prog, prog, prog, prog, prog, prog, prog, prog, prog, prog,
+                    prog, prog, prog, prog, prog, prog, prog);
+}
+
+// Tree daemon: keeps the tree of the given roots in memory, follows changes
+// through inotify and answers requests over a UNIX socket.
+//
+// Every message is a frame, a native uint32_t length and that many bytes.
+// A request is a single frame holding a serve_request followed by the
+// argument (a path, or a substring for find). The answer is a sequence of
+// text frames terminated by an empty one.
+
+enum class serve_kind : uint8_t
+{
+    render,
+    du,
+    find,
+};
+
+struct serve_request
+{
+    serve_kind kind;
+    uint8_t show_hidden;
+    int32_t depth;
+};
+
+bool write_all(int fd, const void* p, size_t n) noexcept
+{
+    auto c = static_cast<const char*>(p);
+    while (n > 0)
+    {
+        ssize_t w = ::write(fd, c, n);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        c += w, n -= w;
+    }
+    return true;
+}
+
+bool read_all(int fd, void* p, size_t n) noexcept
+{
+    auto c = static_cast<char*>(p);
+    while (n > 0)
+    {
+        ssize_t r = ::read(fd, c, n);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        c += r, n -= r;
+    }
+    return true;
+}
+
+bool write_frame(int fd, std::string_view data) noexcept
+{
+    uint32_t len = data.size();
+    return write_all(fd, &len, sizeof(len))
+        && write_all(fd, data.data(), data.size());
+}
+
+std::optional<std::string> read_frame(int fd, uint32_t max = 1 << 20)
+{
+    uint32_t len;
+    if (!read_all(fd, &len, sizeof(len)) || len > max)
+        return std::nullopt;
+    std::string data(len, '\0');
+    if (!read_all(fd, data.data(), len))
+        return std::nullopt;
+    return data;
+}
+
+// Sends everything written to it as frames of up to 64 KiB, so an answer is
+// streamed while the printer produces it.
+class frame_buf : public std::streambuf
+{
+    int fd;
+    char buf[64 * 1024];
+
+public:
+    frame_buf(int fd) : fd(fd) { setp(buf, buf + sizeof(buf)); }
+
+    int sync() override
+    {
+        size_t n = pptr() - pbase();
+        if (n > 0 && !write_frame(fd, { pbase(), n }))
+            return -1;
+        setp(buf, buf + sizeof(buf));
+        return 0;
+    }
+
+    int overflow(int c) override
+    {
+        if (sync() == -1) return traits_type::eof();
+        if (c != traits_type::eof())
+            *pptr() = char(c), pbump(1);
+        return traits_type::not_eof(c);
+    }
+};
+
+class tree_model
+{
+    static constexpr uint32_t watch_mask
+        = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_ONLYDIR;
+
+    struct node
+    {
+        std::string name;
+        uint32_t parent = no_parent;
+        ::mode_t mode = 0;
+        ::off_t size = 0;
+        int wd = -1;
+        std::vector<uint32_t> kids;
+    };
+
+    std::vector<node> nodes;
+    std::vector<uint32_t> free_ids;
+    std::vector<uint32_t> roots;
+    std::unordered_map<int, uint32_t> by_wd;
+    fd_t notify = -1;
+
+    std::string path_of(uint32_t id) const
+    {
+        std::vector<uint32_t> chain;
+        for (; id != no_parent; id = nodes[id].parent)
+            chain.push_back(id);
+        std::string path;
+        for (auto i = chain.rbegin(); i != chain.rend(); ++i)
+        {
+            if (!path.empty() && path.back() != '/') path += '/';
+            path += nodes[*i].name;
+        }
+        return path;
+    }
+
+    uint32_t alloc()
+    {
+        if (free_ids.empty())
+        {
+            nodes.emplace_back();
+            return nodes.size() - 1;
+        }
+        uint32_t id = free_ids.back();
+        free_ids.pop_back();
+        return id;
+    }
+
+    void release(uint32_t id)
+    {
+        for (uint32_t k : nodes[id].kids)
+            release(k);
+        // A directory renamed within the tree keeps its watch descriptor,
+        // which by then belongs to the node added for the new name.
+        auto w = by_wd.find(nodes[id].wd);
+        if (w != by_wd.end() && w->second == id)
+        {
+            ::inotify_rm_watch(notify.fd, nodes[id].wd);
+            by_wd.erase(nodes[id].wd);
+        }
+        nodes[id] = {};
+        free_ids.push_back(id);
+    }
+
+    uint32_t add(const file_t& f, uint32_t parent, std::string& path)
+    {
+        uint32_t id = alloc();
+        nodes[id].name = f.name;
+        nodes[id].parent = parent;
+        nodes[id].mode = f.st.st_mode;
+        nodes[id].size = f.st.st_size;
+        if (!f.is_dir()) return id;
+
+        int wd = ::inotify_add_watch(notify.fd, path.c_str(), watch_mask);
+        if (wd != -1)
+            nodes[id].wd = wd, by_wd[wd] = id;
+
+        size_t len = path.size();
+        for (auto it = f.begin(); it != f.end(); ++it)
+        {
+            if (path.back() != '/') path += '/';
+            path += *it.d_name;
+            uint32_t kid = add(*it, id, path);
+            nodes[id].kids.push_back(kid);
+            path.resize(len);
+        }
+        return id;
+    }
+
+    // Brings the direct entries of a directory up to date, new
+    // subdirectories are read whole.
+    void refresh(uint32_t id)
+    {
+        auto path = path_of(id);
+        auto dir = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        if (!dir.is_dir()) return;
+
+        std::unordered_map<std::string, uint32_t> old;
+        for (uint32_t k : nodes[id].kids)
+            old.emplace(nodes[k].name, k);
+
+        std::vector<uint32_t> kids;
+        size_t len = path.size();
+        for (auto it = dir.begin(); it != dir.end(); ++it)
+        {
+            auto f = *it;
+            auto o = old.find(f.name);
+            if (o != old.end() && !f.error()
+                && (f.st.st_mode & S_IFMT) == (nodes[o->second].mode & S_IFMT))
+            {
+                nodes[o->second].mode = f.st.st_mode;
+                nodes[o->second].size = f.st.st_size;
+                kids.push_back(o->second);
+                old.erase(o);
+                continue;
+            }
+            if (path.back() != '/') path += '/';
+            path += f.name;
+            kids.push_back(add(f, id, path));
+            path.resize(len);
+        }
+        for (auto [name, k] : old)
+            release(k);
+        nodes[id].kids = std::move(kids);
+    }
+
+    std::optional<uint32_t> lookup(std::string_view path) const
+    {
+        for (uint32_t r : roots)
+        {
+            std::string_view root = nodes[r].name;
+            if (!path.starts_with(root)) continue;
+            auto rest = path.substr(root.size());
+            if (!rest.empty() && rest[0] != '/' && root != "/") continue;
+
+            uint32_t id = r;
+            while (!rest.empty())
+            {
+                while (rest.starts_with('/')) rest.remove_prefix(1);
+                auto name = rest.substr(0, rest.find('/'));
+                rest.remove_prefix(name.size());
+                if (name.empty()) break;
+
+                auto& kids = nodes[id].kids;
+                auto k = std::find_if(kids.begin(), kids.end(),
+                    [&](uint32_t k) { return nodes[k].name == name; });
+                if (k == kids.end()) return std::nullopt;
+                id = *k;
+            }
+            return id;
+        }
+        return std::nullopt;
+    }
+
+public:
+    struct view;
+
+    struct iter
+    {
+        const tree_model* m = nullptr;
+        const uint32_t* p = nullptr;
+        const uint32_t* e = nullptr;
+        bool skip_hidden = false;
+
+        bool hidden(const uint32_t* q) const noexcept
+        {
+            return skip_hidden && m->nodes[*q].name.starts_with('.');
+        }
+        void skip() noexcept { while (p != e && hidden(p)) ++p; }
+
+        const maybe_err& error() const noexcept
+        {
+            static const maybe_err no_error;
+            return no_error;
+        }
+        bool is_last() const noexcept
+        {
+            auto q = p + 1;
+            while (q != e && hidden(q)) ++q;
+            return q == e;
+        }
+        view operator*() const noexcept { return { m, *p }; }
+        iter& operator++() noexcept { ++p; skip(); return *this; }
+
+        friend bool operator==(const iter& a, const iter& b) noexcept
+        {
+            return a.p == b.p;
+        }
+    };
+
+    struct view
+    {
+        const tree_model* m;
+        uint32_t id;
+
+        iter begin(bool skip_hidden = false) const noexcept
+        {
+            const auto& k = m->nodes[id].kids;
+            iter it{ m, k.data(), k.data() + k.size(), skip_hidden };
+            it.skip();
+            return it;
+        }
+        iter end() const noexcept
+        {
+            const auto& k = m->nodes[id].kids;
+            return { m, k.data() + k.size(), k.data() + k.size() };
+        }
+
+        std::string_view name() const noexcept { return m->nodes[id].name; }
+
+        friend std::ostream& operator<<(std::ostream& o, const view& v)
+        {
+            return o << v.name();
+        }
+    };
+
+    maybe_err start()
+    {
+        notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (notify.fd == -1)
+            return err_t::last(op_t::inotify);
+        return {};
+    }
+
+    int fd() const noexcept { return notify.fd; }
+
+    void add_root(std::string path)
+    {
+        while (path.size() > 1 && path.back() == '/')
+            path.pop_back();
+        roots.push_back(add(file_t(make_ref<fd_t>(AT_FDCWD), path),
+                            no_parent, path));
+    }
+
+    // Applies all pending inotify events.
+    void update()
+    {
+        alignas(inotify_event) char buf[64 * 1024];
+        std::vector<uint32_t> dirty;
+        bool overflow = false;
+
+        ssize_t n;
+        while ((n = ::read(notify.fd, buf, sizeof(buf))) > 0)
+        {
+            for (char* p = buf; p < buf + n; )
+            {
+                auto ev = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) overflow = true;
+                auto w = by_wd.find(ev->wd);
+                if (w == by_wd.end()) continue;
+                if (ev->mask & IN_IGNORED)
+                {
+                    nodes[w->second].wd = -1;
+                    by_wd.erase(w);
+                    continue;
+                }
+                dirty.push_back(w->second);
+            }
+        }
+
+        // Lost events may be anywhere, every directory is reread from the
+        // roots down. refresh() keeps unchanged subdirectories as they are,
+        // so each one is queued after its parent.
+        if (overflow)
+        {
+            std::deque<uint32_t> queue;
+            for (uint32_t r : roots)
+                if (S_ISDIR(nodes[r].mode)) queue.push_back(r);
+            while (!queue.empty())
+            {
+                uint32_t id = queue.front();
+                queue.pop_front();
+                refresh(id);
+                for (uint32_t k : nodes[id].kids)
+                    if (S_ISDIR(nodes[k].mode)) queue.push_back(k);
+            }
+            return;
+        }
+
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        for (uint32_t id : dirty)
+            if (nodes[id].wd != -1) refresh(id);
+    }
+
+    void answer(int client, const serve_request& req, std::string_view arg)
+    {
+        frame_buf buf(client);
+        std::ostream out(&buf);
+
+        std::vector<uint32_t> ids;
+        if (arg.empty() || req.kind == serve_kind::find)
+            ids = roots;
+        else if (auto id = lookup(arg))
+            ids.push_back(*id);
+        else
+            out << "not in the served tree: " << arg << "\n";
+
+        for (uint32_t id : ids)
+        {
+            if (req.kind == serve_kind::render)
+            {
+                if (id != ids.front()) out << "\n";
+                printer(req.show_hidden).print(view{ this, id }, out,
+                                               req.depth);
+            }
+            else if (req.kind == serve_kind::du)
+            {
+                uint64_t bytes = 0, files = 0, dirs = 0;
+                std::vector<uint32_t> stack = { id };
+                while (!stack.empty())
+                {
+                    const auto& n = nodes[stack.back()];
+                    stack.pop_back();
+                    bytes += n.size;
+                    ++(S_ISDIR(n.mode) ? dirs : files);
+                    stack.insert(stack.end(), n.kids.begin(), n.kids.end());
+                }
+                out << bytes << " bytes, " << files << " files, "
+                    << dirs << " directories\t" << path_of(id) << "\n";
+            }
+            else if (req.kind == serve_kind::find)
+            {
+                std::string path = nodes[id].name;
+                find(id, path, arg, out);
+            }
+        }
+        out.flush();
+        write_frame(client, {});
+    }
+
+private:
+    void find(uint32_t id, std::string& path, std::string_view pattern,
+              std::ostream& out) const
+    {
+        if (path.find(pattern) != std::string::npos)
+            out << path << "\n";
+        size_t len = path.size();
+        for (uint32_t k : nodes[id].kids)
+        {
+            if (path.back() != '/') path += '/';
+            path += nodes[k].name;
+            find(k, path, pattern, out);
+            path.resize(len);
+        }
+    }
+};
+
+std::optional<fd_t> unix_socket(const char* path, bool listen)
+{
+    ::sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(addr.sun_path))
+        return errno = ENAMETOOLONG, std::nullopt;
+    std::strcpy(addr.sun_path, path);
+
+    fd_t fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd.fd == -1) return std::nullopt;
+
+    auto sa = reinterpret_cast<const ::sockaddr*>(&addr);
+    if (listen)
+    {
+        // Only a stale socket is replaced, never another kind of file.
+        struct stat st;
+        if (::lstat(path, &st) == 0)
+        {
+            if (!S_ISSOCK(st.st_mode))
+                return errno = EEXIST, std::nullopt;
+            ::unlink(path);
+        }
+        if (::bind(fd.fd, sa, sizeof(addr)) == -1
+            || ::listen(fd.fd, 16) == -1)
+            return std::nullopt;
+    }
+    else if (::connect(fd.fd, sa, sizeof(addr)) == -1)
+        return std::nullopt;
+
+    return std::optional<fd_t>(std::move(fd));
+}
+
+int serve(const char* prog, const char* socket, int ndirs, char** dirs)
+{
+    tree_model model;
+    if (auto err = model.start())
+    {
+        err->message(std::cerr << prog << ": ") << "\n";
+        return 1;
+    }
+    if (ndirs == 0)
+        model.add_root(".");
+    for (int i = 0; i < ndirs; ++i)
+        model.add_root(dirs[i]);
+
+    auto listener = unix_socket(socket, true);
+    if (!listener)
+    {
+        err_t::last(op_t::socket).message(
+            std::cerr << prog << ": " << socket << ": ") << "\n";
+        return 1;
+    }
+    ::signal(SIGPIPE, SIG_IGN);
+
+    for (;;)
+    {
+        ::pollfd fds[] = {
+            { listener->fd, POLLIN, 0 },
+            { model.fd(), POLLIN, 0 },
+        };
+        if (::poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR) continue;
+            err_t::last(op_t::poll).message(std::cerr << prog << ": ") << "\n";
+            return 1;
+        }
+
+        if (fds[1].revents & POLLIN)
+            model.update();
+
+        if (fds[0].revents & POLLIN)
+        {
+            fd_t client = ::accept4(listener->fd, nullptr, nullptr,
+                                    SOCK_CLOEXEC);
+            if (client.fd == -1) continue;
+
+            // A client that stalls is dropped instead of blocking the
+            // others and the change queue.
+            ::timeval timeout = { 1, 0 };
+            ::setsockopt(client.fd, SOL_SOCKET, SO_RCVTIMEO,
+                         &timeout, sizeof(timeout));
+            ::setsockopt(client.fd, SOL_SOCKET, SO_SNDTIMEO,
+                         &timeout, sizeof(timeout));
+
+            // Changes that arrived meanwhile are applied before answering.
+            model.update();
+
+            auto req = read_frame(client.fd);
+            if (!req || req->size() < sizeof(serve_request)) continue;
+
+            serve_request r;
+            std::memcpy(&r, req->data(), sizeof(r));
+            model.answer(client.fd, r,
+                         std::string_view(*req).substr(sizeof(r)));
+        }
+    }
+}
+
+int serve_client(const char* prog, const char* socket, std::string_view cmd,
+                 std::string_view arg, bool show_hidden, int depth)
+{
+    serve_request r = { serve_kind::render, show_hidden, depth };
+    if (cmd == "du") r.kind = serve_kind::du;
+    else if (cmd == "find") r.kind = serve_kind::find;
+    else if (cmd != "render") return usage(prog), 1;
+
+    auto fd = unix_socket(socket, false);
+    if (!fd)
+    {
+        err_t::last(op_t::socket).message(
+            std::cerr << prog << ": " << socket << ": ") << "\n";
+        return 1;
+    }
+
+    std::string req(reinterpret_cast<const char*>(&r), sizeof(r));
+    req += arg;
+    if (!write_frame(fd->fd, req))
+        return 1;
+
+    while (auto frame = read_frame(fd->fd, UINT32_MAX))
+    {
+        if (frame->empty()) return 0;
+        std::cout << *frame;
+    }
+    std::cerr << prog << ": " << socket << ": connection closed early\n";
+    return 1;
+}
+
+// Flat tabular output, one row per entry.
+
+// Collects output and writes it to a descriptor in large chunks.
+class out_sink
+{
+    int fd;
+    std::string buf;
+    size_t cap;
+    // The first write that failed, later output is dropped.
+    maybe_err err_ = {};
+
+public:
+    out_sink(int fd, size_t cap = 1 << 20) : fd(fd), cap(cap)
+    {
+        buf.reserve(cap);
+    }
+    ~out_sink() { flush(); }
+
+    out_sink(const out_sink&) = delete;
+    out_sink& operator=(const out_sink&) = delete;
+
+    // False when this or any earlier write failed.
+    bool flush() noexcept
+    {
+        if (!err_ && !write_all(fd, buf.data(), buf.size()))
+            err_ = err_t::last(op_t::write);
+        buf.clear();
+        return !err_;
+    }
+
+    const auto& error() const noexcept { return err_; }
+
+    void put(char c)
+    {
+        buf += c;
+        if (buf.size() >= cap) flush();
+    }
+
+    void put(std::string_view s)
+    {
+        buf += s;
+        if (buf.size() >= cap) flush();
+    }
+
+    template<typename T>
+    void num(T v, int base = 10)
+    {
+        char tmp[24];
+        auto r = std::to_chars(tmp, tmp + sizeof(tmp), v, base);
+        put({ tmp, size_t(r.ptr - tmp) });
+    }
+};
+
+// Whether any byte of w equals b.
+constexpr bool has_byte(uint64_t w, uint8_t b) noexcept
+{
+    constexpr uint64_t ones = 0x0101010101010101ull;
+    uint64_t x = w ^ (ones * b);
+    return (x - ones) & ~x & (ones << 7);
+}
+
+// Whether s contains any of the (up to four) bytes in set, checked eight
+// bytes at a time.
+bool contains_any(std::string_view s, const char (&set)[5]) noexcept
+{
+    size_t i = 0;
+    for (; i + 8 <= s.size(); i += 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, s.data() + i, 8);
+        if (has_byte(w, set[0]) | has_byte(w, set[1])
+          | has_byte(w, set[2]) | has_byte(w, set[3]))
+            return true;
+    }
+    for (; i < s.size(); ++i)
+        if (s[i] == set[0] || s[i] == set[1]
+         || s[i] == set[2] || s[i] == set[3])
+            return true;
+    return false;
+}
+
+enum class column : uint8_t { path, depth, type, size, mtime, mode, error };
+
+constexpr std::pair<std::string_view, column> column_names[] = {
+    { "path", column::path }, { "depth", column::depth },
+    { "type", column::type }, { "size", column::size },
+    { "mtime", column::mtime }, { "mode", column::mode },
+    { "error", column::error },
+};
+
+// Parses a comma separated list of column names.
+std::optional<std::vector<column>> parse_columns(std::string_view list)
+{
+    std::vector<column> cols;
+    while (!list.empty())
+    {
+        auto name = list.substr(0, list.find(','));
+        list.remove_prefix(std::min(list.size(), name.size() + 1));
+        auto c = std::find_if(std::begin(column_names), std::end(column_names),
+                              [&](auto& p) { return p.first == name; });
+        if (c == std::end(column_names)) return std::nullopt;
+        cols.push_back(c->second);
+    }
+    if (cols.empty()) return std::nullopt;
+    return cols;
+}
+
+// CSV quotes a field only when it holds a separator, quote or line break,
+// as in RFC 4180. TSV cannot quote, so tabs, line breaks and backslashes
+// are escaped with a backslash instead.
+class table_writer
+{
+    out_sink out;
+    std::vector<column> cols;
+    char sep;
+    bool show_hidden;
+    int max_depth;
+    error_summary errors;
+
+    void text(std::string_view s)
+    {
+        if (sep == ',')
+        {
+            if (!contains_any(s, ",\"\n\r"))
+                return out.put(s);
+            out.put('"');
+            for (size_t q; (q = s.find('"')) != s.npos; s.remove_prefix(q + 1))
+                out.put(s.substr(0, q + 1)), out.put('"');
+            out.put(s);
+            out.put('"');
+            return;
+        }
+
+        if (!contains_any(s, "\t\n\r\\"))
+            return out.put(s);
+        for (char c : s)
+        {
+            switch (c)
+            {
+                case '\t': out.put("\\t"); break;
+                case '\n': out.put("\\n"); break;
+                case '\r': out.put("\\r"); break;
+                case '\\': out.put("\\\\"); break;
+                default: out.put(c);
+            }
+        }
+    }
+
+    void row(const file_t& f, const std::string& path, int depth)
+    {
+        bool ok = !f.error();
+        if (!ok) errors.add(*f.error());
+        for (size_t i = 0; i < cols.size(); ++i)
+        {
+            if (i > 0) out.put(sep);
+            switch (cols[i])
+            {
+                case column::path:  text(path); break;
+                case column::depth: out.num(depth); break;
+                case column::type:  out.put(f.type_name()); break;
+                case column::size:  if (ok) out.num(f.st.st_size); break;
+                case column::mtime: if (ok) out.num(f.st.st_mtim.tv_sec); break;
+                case column::mode:  if (ok) out.num(f.st.st_mode, 8); break;
+                case column::error: if (!ok) text(f.error()->text()); break;
+            }
+        }
+        out.put('\n');
+    }
+
+    // A directory that fails to open or read, on a row below its own.
+    void error_row(const err_t& e, const std::string& path, int depth)
+    {
+        errors.add(e);
+        for (size_t i = 0; i < cols.size(); ++i)
+        {
+            if (i > 0) out.put(sep);
+            switch (cols[i])
+            {
+                case column::path:  text(path); break;
+                case column::depth: out.num(depth); break;
+                case column::type:  out.put("error"); break;
+                case column::error: text(e.text()); break;
+                default: break;
+            }
+        }
+        out.put('\n');
+    }
+
+    void walk(const file_t& f, std::string& path, int depth)
+    {
+        row(f, path, depth);
+        if (depth == max_depth) return;
+
+        size_t len = path.size();
+        auto it = f.begin(!show_hidden);
+        for (; it != f.end(); ++it)
+        {
+            if (path.back() != '/') path += '/';
+            path += *it.d_name;
+            walk(*it, path, depth + 1);
+            path.resize(len);
+        }
+        if (it.error()) error_row(*it.error(), path, depth + 1);
+    }
+
+public:
+    // max_depth of -1 means no limit.
+    table_writer(std::vector<column> cols, char sep, bool show_hidden,
+                 int max_depth)
+        : out(1), cols(std::move(cols)), sep(sep),
+          show_hidden(show_hidden), max_depth(max_depth)
+    {
+        for (size_t i = 0; i < this->cols.size(); ++i)
+        {
+            if (i > 0) out.put(sep);
+            for (auto& [name, c] : column_names)
+                if (c == this->cols[i]) out.put(name);
+        }
+        out.put('\n');
+    }
+
+    void add_root(std::string path)
+    {
+        walk(file_t(make_ref<fd_t>(AT_FDCWD), path), path, 0);
+    }
+
+    bool flush() noexcept { return out.flush(); }
+    const auto& error() const noexcept { return out.error(); }
+    const error_summary& walk_errors() const noexcept { return errors; }
+};
+
+// Self-contained HTML output for trees too large to render as a whole.
+//
+// The page embeds the tree as text, one line per directory, and builds
+// list items only for the directories the user expands. A directory line
+// is "ID" followed by a tab separated entry per child:
+//   d<ID>/name   directory, listed on the line starting with ID
+//   d-/name      directory past the depth limit, not listed
+//   f<size>/name regular file
+//   l0/name, o0/name, e0/name   symlink, other, entry that failed to stat
+//   !message     the directory could not be read
+// '/' cannot occur in a name, so it ends the number. Names escape '\',
+// tab, newline and '<' as \\, \t, \n and \l. Lines are written once a
+// directory is done, so a walk only keeps the lines of the open
+// directories; the roots are on a last line starting with R.
+
+constexpr std::string_view html_head = R"(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><title>tree</title>
+<style>
+body { font: 14px monospace; }
+ul { list-style: none; padding-left: 1.5em; margin: 0; }
+li.dir > span { cursor: pointer; font-weight: bold; }
+li.dir.closed > span::before { content: "▸ "; }
+li.dir.open > span::before { content: "▾ "; }
+small { color: #888; }
+.err { color: #c00; }
+</style></head><body>
+<ul id="tree"></ul>
+<script type="text/plain" id="data">)";
+
+constexpr std::string_view html_tail = R"(</script>
+<script>
+const lines = document.getElementById('data').textContent.split('\n');
+const dirs = new Map();
+let roots = '';
+for (let i = 0; i < lines.length; ++i) {
+  const l = lines[i];
+  if (l[0] === 'R') { roots = l; continue; }
+  const t = l.indexOf('\t');
+  dirs.set(t === -1 ? l : l.slice(0, t), i);
+}
+const unesc = s => s.replace(/\\(.)/g,
+  (m, c) => ({ t: '\t', n: '\n', l: '<' })[c] ?? c);
+const size = n => {
+  const u = ['B', 'K', 'M', 'G', 'T', 'P'];
+  let i = 0;
+  for (; n >= 1024 && i < u.length - 1; ++i) n /= 1024;
+  return (i ? n.toFixed(1) : n) + u[i];
+};
+function render(ul, line) {
+  for (const e of line.split('\t').slice(1)) {
+    const li = document.createElement('li');
+    if (e[0] === '!') {
+      li.className = 'err';
+      li.textContent = '(error: ' + unesc(e.slice(1)) + ')';
+    } else {
+      const slash = e.indexOf('/');
+      const kind = e[0], num = e.slice(1, slash);
+      const name = unesc(e.slice(slash + 1));
+      if (kind === 'd') {
+        const s = document.createElement('span');
+        s.textContent = name;
+        li.append(s);
+        li.className = 'dir';
+        if (num !== '-') { li.dataset.id = num; li.classList.add('closed'); }
+      } else {
+        li.textContent = name;
+        if (kind === 'f') {
+          const z = document.createElement('small');
+          z.textContent = ' ' + size(+num);
+          li.append(z);
+        }
+        if (kind === 'e') li.className = 'err';
+      }
+    }
+    ul.append(li);
+  }
+}
+function toggle(li) {
+  if (li.classList.contains('open')) {
+    li.querySelector(':scope > ul').remove();
+    li.classList.replace('open', 'closed');
+  } else {
+    const ul = document.createElement('ul');
+    render(ul, lines[dirs.get(li.dataset.id)]);
+    li.append(ul);
+    li.classList.replace('closed', 'open');
+  }
+}
+const tree = document.getElementById('tree');
+render(tree, roots);
+for (const li of tree.children) if (li.dataset.id) toggle(li);
+tree.addEventListener('click', ev => {
+  const s = ev.target.closest('li.dir > span');
+  if (s && s.parentElement.dataset.id) toggle(s.parentElement);
+});
+</script></body></html>
+)";
+
+class html_writer
+{
+    out_sink out;
+    bool show_hidden;
+    int max_depth;
+    uint64_t next_id = 0;
+    std::string roots = "R";
+
+    static void escape(std::string& to, std::string_view s)
+    {
+        if (!contains_any(s, "\\\t\n<"))
+        {
+            to += s;
+            return;
+        }
+        for (char c : s)
+        {
+            switch (c)
+            {
+                case '\\': to += "\\\\"; break;
+                case '\t': to += "\\t"; break;
+                case '\n': to += "\\n"; break;
+                case '<':  to += "\\l"; break;
+                default: to += c;
+            }
+        }
+    }
+
+    static void number(std::string& to, uint64_t v)
+    {
+        char tmp[24];
+        auto r = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        to.append(tmp, r.ptr);
+    }
+
+    static void error(std::string& line, const err_t& e)
+    {
+        line += "\t!";
+        escape(line, e.text());
+    }
+
+    // Appends the field of f to its parent's line.
+    void entry(std::string& line, const file_t& f, int depth)
+    {
+        line += '\t';
+        if (f.is_dir() && depth == max_depth)
+            line += "d-/";
+        else if (f.is_dir())
+        {
+            uint64_t id = next_id++;
+            line += 'd';
+            number(line, id);
+            line += '/';
+            listing(f, id, depth);
+        }
+        else if (f.error())
+            line += "e0/";
+        else if (S_ISREG(f.st.st_mode))
+        {
+            line += 'f';
+            number(line, f.st.st_size);
+            line += '/';
+        }
+        else
+            line += S_ISLNK(f.st.st_mode) ? "l0/" : "o0/";
+        escape(line, f.name);
+    }
+
+    void listing(const file_t& f, uint64_t id, int depth)
+    {
+        std::string line;
+        number(line, id);
+
+        auto it = f.begin(!show_hidden);
+        if (it.error())
+            error(line, *it.error());
+        for (; it != f.end(); ++it)
+            entry(line, *it, depth + 1);
+        if (it.error())
+            error(line, *it.error());
+
+        line += '\n';
+        out.put(line);
+    }
+
+public:
+    // max_depth of -1 means no limit.
+    html_writer(bool show_hidden, int max_depth)
+        : out(1), show_hidden(show_hidden), max_depth(max_depth)
+    {
+        out.put(html_head);
+    }
+
+    void add_root(const char* path)
+    {
+        entry(roots, file_t(make_ref<fd_t>(AT_FDCWD), path), 0);
+    }
+
+    bool finish()
+    {
+        out.put(roots);
+        out.put(html_tail);
+        return out.flush();
+    }
+
+    const auto& error() const noexcept { return out.error(); }
+};
+
+// Interactive browser: directories are read only when expanded.
+
+// What the browser shows of an entry. No file_t is kept, its 'at' would hold
+// the parent directory open for the rest of the session.
+struct tui_entry
+{
+    std::string name;
+    ::mode_t mode = 0;
+    maybe_err err_ = {};
+
+    tui_entry(const file_t& f) : name(f.name), mode(f.st.st_mode), err_(f.error()) {}
+
+    const auto& error() const noexcept { return err_; }
+    bool is_dir() const noexcept { return !err_ && S_ISDIR(mode); }
+};
+
+struct tui_node
+{
+    tui_entry file;
+    tui_node* parent = nullptr;
+    std::vector<std::unique_ptr<tui_node>> kids;
+    maybe_err error = {};
+    bool loaded = false;
+    bool open = false;
+    size_t accounted = 0;   // of the loaded kids
+
+    tui_node(const file_t& f, tui_node* parent)
+        : file(f), parent(parent) {}
+    ~tui_node() { Memory.release(accounted); }
+
+    tui_node(const tui_node&) = delete;
+    tui_node& operator=(const tui_node&) = delete;
+
+    void load(bool skip_hidden)
+    {
+        if (loaded || !file.is_dir()) return;
+        loaded = true;
+
+        // Opened again by path, which is released once it is read.
+        auto dir = file_t(make_ref<fd_t>(AT_FDCWD), path());
+        if (dir.error())
+        {
+            error = *dir.error();
+            return;
+        }
+        auto it = dir.begin(skip_hidden);
+        for (; it != dir.end(); ++it)
+        {
+            kids.push_back(std::make_unique<tui_node>(*it, this));
+            accounted += sizeof(tui_node) + kids.back()->file.name.size();
+        }
+        Memory.force(accounted);
+        if (it.error())
+            error = *it.error();
+    }
+
+    std::string path() const
+    {
+        if (!parent) return file.name;
+        auto p = parent->path();
+        if (p.back() != '/') p += '/';
+        return p + file.name;
+    }
+};
+
+// Reads the directories the user is likely to open next on a thread of its
+// own. The results are thrown away, the point is that the kernel (or the
+// NFS client) has the entries cached when the directory is expanded. The
+// thread only gets paths, so no handles are shared with it.
+class prefetcher
+{
+    struct state
+    {
+        std::mutex m;
+        std::condition_variable cv;
+        std::vector<std::string> queue;
+        bool stop = false;
+    };
+    std::shared_ptr<state> s = std::make_shared<state>();
+
+    static void warm(const std::string& path) noexcept
+    {
+        DIR* dir = ::opendir(path.c_str());
+        if (!dir) return;
+        struct stat st;
+        while (auto e = ::readdir(dir))
+            ::fstatat(::dirfd(dir), e->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        ::closedir(dir);
+    }
+
+public:
+    prefetcher()
+    {
+        std::thread([s = s]
+        {
+            for (;;)
+            {
+                std::string path;
+                {
+                    std::unique_lock lock(s->m);
+                    s->cv.wait(lock, [&] { return s->stop || !s->queue.empty(); });
+                    if (s->stop) return;
+                    path = std::move(s->queue.back());
+                    s->queue.pop_back();
+                }
+                warm(path);
+            }
+        }).detach();
+    }
+
+    // The thread may be stuck on a dead mount, so it is not waited for.
+    ~prefetcher()
+    {
+        std::lock_guard lock(s->m);
+        s->stop = true;
+        s->cv.notify_one();
+    }
+
+    // Replaces what is still queued, the first path is read first.
+    void want(std::vector<std::string> paths)
+    {
+        std::reverse(paths.begin(), paths.end());
+        std::lock_guard lock(s->m);
+        s->queue = std::move(paths);
+        s->cv.notify_one();
+    }
+};
+
+class raw_terminal
+{
+    ::termios saved = {};
+    bool ok = false;
+
+public:
+    raw_terminal()
+    {
+        if (::tcgetattr(0, &saved) == -1) return;
+        ::termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+        raw.c_iflag &= ~(IXON | ICRNL);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        ok = ::tcsetattr(0, TCSAFLUSH, &raw) == 0;
+        if (ok) write_all(1, "\e[?1049h\e[?25l", 14);
+    }
+    ~raw_terminal()
+    {
+        if (!ok) return;
+        write_all(1, "\e[?25h\e[?1049l", 14);
+        ::tcsetattr(0, TCSAFLUSH, &saved);
+    }
+
+    explicit operator bool() const { return ok; }
+};
+
+enum class key { none, up, down, left, right, enter, page_up, page_down,
+                 home, end, search, next, quit, backspace, escape, text };
+
+class tui
+{
+    std::vector<std::unique_ptr<tui_node>> roots;
+    bool show_hidden;
+
+    struct row
+    {
+        tui_node* node;
+        std::string prefix;
+    };
+    std::vector<row> rows;
+    size_t cursor = 0;
+    size_t top = 0;
+
+    bool searching = false;
+    std::string query;
+
+    prefetcher prefetch;
+
+    void add_rows(tui_node* n, const std::string& indent)
+    {
+        if (!n->open) return;
+        for (size_t i = 0; i < n->kids.size(); ++i)
+        {
+            bool last = i + 1 == n->kids.size();
+            rows.push_back({ n->kids[i].get(), indent + (last ? "└── " : "├── ") });
+            add_rows(n->kids[i].get(), indent + (last ? "    " : "│   "));
+        }
+    }
+
+    // Rebuilds the visible rows, keeping the cursor on node at.
+    void flatten(tui_node* at = nullptr)
+    {
+        if (!at && !rows.empty()) at = rows[cursor].node;
+        rows.clear();
+        for (auto& r : roots)
+        {
+            rows.push_back({ r.get(), "" });
+            add_rows(r.get(), "");
+        }
+        cursor = 0;
+        for (size_t i = 0; i < rows.size(); ++i)
+            if (rows[i].node == at) cursor = i;
+    }
+
+    void expand(tui_node* n)
+    {
+        n->load(!show_hidden);
+        n->open = n->file.is_dir();
+        flatten();
+    }
+
+    // Next loaded node after the cursor, in display order, whose name
+    // contains the query; its ancestors are opened to show it.
+    void find(bool skip_current)
+    {
+        if (query.empty()) return;
+
+        std::vector<tui_node*> order;
+        auto collect = [&](auto& self, tui_node* n) -> void
+        {
+            order.push_back(n);
+            for (auto& k : n->kids) self(self, k.get());
+        };
+        for (auto& r : roots) collect(collect, r.get());
+
+        auto pos = std::find(order.begin(), order.end(), rows[cursor].node);
+        size_t start = pos - order.begin() + (skip_current ? 1 : 0);
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            auto n = order[(start + i) % order.size()];
+            if (n->file.name.find(query) == std::string::npos) continue;
+            for (auto p = n->parent; p; p = p->parent) p->open = true;
+            flatten(n);
+            return;
+        }
+    }
+
+    void want_next()
+    {
+        std::vector<std::string> paths;
+        size_t ahead = Memory.over() ? 1 : 4;
+        for (size_t i = cursor; i < rows.size() && paths.size() < ahead; ++i)
+        {
+            auto n = rows[i].node;
+            if (n->file.is_dir() && !n->loaded) paths.push_back(n->path());
+        }
+        if (!paths.empty()) prefetch.want(std::move(paths));
+    }
+
+    static key read_key(char& c)
+    {
+        if (::read(0, &c, 1) != 1) return key::quit;
+        if (c != '\e')
+        {
+            switch (c)
+            {
+                case 'q': case 3: return key::quit;
+                case 'k': return key::up;
+                case 'j': return key::down;
+                case 'h': return key::left;
+                case 'l': return key::right;
+                case '\r': case '\n': case ' ': return key::enter;
+                case '/': return key::search;
+                case 'n': return key::next;
+                case 127: case 8: return key::backspace;
+            }
+            return key::text;
+        }
+
+        // A lone escape is not followed by more input.
+        ::pollfd p = { 0, POLLIN, 0 };
+        char seq[3] = {};
+        if (::poll(&p, 1, 30) <= 0 || ::read(0, seq, 1) != 1 || seq[0] != '[')
+            return key::escape;
+        if (::read(0, seq + 1, 1) != 1) return key::escape;
+        switch (seq[1])
+        {
+            case 'A': return key::up;
+            case 'B': return key::down;
+            case 'C': return key::right;
+            case 'D': return key::left;
+            case 'H': return key::home;
+            case 'F': return key::end;
+        }
+        if (seq[1] >= '0' && seq[1] <= '9' && ::read(0, seq + 2, 1) == 1)
+        {
+            if (seq[1] == '5') return key::page_up;
+            if (seq[1] == '6') return key::page_down;
+        }
+        return key::none;
+    }
+
+    // Cuts s to at most cols terminal columns, counting UTF-8 sequences.
+    static std::string_view fit(std::string_view s, size_t cols)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < s.size(); ++i)
+            if ((s[i] & 0xc0) != 0x80 && n++ == cols)
+                return s.substr(0, i);
+        return s;
+    }
+
+    void draw(size_t height, size_t width)
+    {
+        size_t lines = height > 1 ? height - 1 : 1;
+        if (cursor < top) top = cursor;
+        if (cursor >= top + lines) top = cursor - lines + 1;
+
+        std::string out = "\e[H";
+        for (size_t i = top; i < top + lines; ++i)
+        {
+            if (i < rows.size())
+            {
+                auto n = rows[i].node;
+                std::string line = rows[i].prefix + n->file.name;
+                if (n->file.is_dir() && !n->open) line += "/";
+                if (auto& e = n->file.error() ? n->file.error() : n->error)
+                    line += " (error: " + e->text() + ")";
+
+                if (i == cursor) out += "\e[7m";
+                else if (n->file.is_dir()) out += "\e[1m";
+                out += fit(line, width);
+                out += "\e[0m";
+            }
+            out += "\e[K\r\n";
+        }
+
+        std::string status = searching ? "/" + query
+                                       : rows[cursor].node->path();
+        out += "\e[7m";
+        out += fit(status, width);
+        out += "\e[K\e[0m";
+        write_all(1, out.data(), out.size());
+    }
+
+public:
+    tui(bool show_hidden) : show_hidden(show_hidden) {}
+
+    void add_root(const char* path)
+    {
+        roots.push_back(std::make_unique<tui_node>(
+            file_t(make_ref<fd_t>(AT_FDCWD), path), nullptr));
+        roots.back()->load(!show_hidden);
+        roots.back()->open = roots.back()->file.is_dir();
+    }
+
+    void run()
+    {
+        flatten();
+        for (;;)
+        {
+            ::winsize ws = {};
+            if (::ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0)
+                ws.ws_row = 24, ws.ws_col = 80;
+            size_t page = ws.ws_row > 2 ? ws.ws_row - 2 : 1;
+
+            want_next();
+            draw(ws.ws_row, ws.ws_col);
+
+            char c;
+            key k = read_key(c);
+            auto n = rows[cursor].node;
+
+            // While searching, every printable byte goes to the query.
+            if (searching)
+            {
+                if (c != '\e' && uint8_t(c) >= 0x20 && c != 127)
+                    query += c, find(false);
+                else if (k == key::backspace && !query.empty())
+                    query.pop_back();
+                else if (k == key::enter || k == key::escape)
+                    searching = false;
+                else if (k == key::quit)
+                    return;
+                continue;
+            }
+
+            switch (k)
+            {
+                case key::quit: return;
+                case key::up: if (cursor > 0) --cursor; break;
+                case key::down: if (cursor + 1 < rows.size()) ++cursor; break;
+                case key::page_up: cursor -= std::min(cursor, page); break;
+                case key::page_down:
+                    cursor = std::min(rows.size() - 1, cursor + page);
+                    break;
+                case key::home: cursor = 0; break;
+                case key::end: cursor = rows.size() - 1; break;
+                case key::right:
+                    if (n->open && cursor + 1 < rows.size()) ++cursor;
+                    else expand(n);
+                    break;
+                case key::enter:
+                    if (n->open) n->open = false, flatten();
+                    else expand(n);
+                    break;
+                case key::left:
+                    if (n->open) n->open = false, flatten();
+                    else if (n->parent) flatten(n->parent);
+                    break;
+                case key::search: searching = true, query.clear(); break;
+                case key::next: find(true); break;
+                default: break;
+            }
+        }
+    }
+};
+
+int uring_show(const char* prog, int ndirs, char** dirs, bool show_hidden,
+               int depth)
+{
+    const char* here = ".";
+    if (ndirs == 0)
+        ndirs = 1, dirs = const_cast<char**>(&here);
+
+    for (int i = 0; i < ndirs; ++i)
+    {
+        if (i > 0) std::cout << "\n";
+        uring_walker walker(show_hidden);
+        uring_walker::entry root{ dirs[i] };
+        auto err = walker.init();
+        if (!err) err = walker.walk(root, depth == -1 ? -1 : depth - 1);
+        if (err)
+        {
+            err->message(std::cerr << prog << ": ") << "\n";
+            return 1;
+        }
+        printer(show_hidden).print(uring_walker::node{ &root }, std::cout, depth);
+    }
+    return 0;
+}
+
+int git_show(const char* prog, int ndirs, char** dirs, bool show_hidden,
+             int depth)
+{
+    const char* here = ".";
+    if (ndirs == 0)
+        ndirs = 1, dirs = const_cast<char**>(&here);
+
+    for (int i = 0; i < ndirs; ++i)
+    {
+        if (i > 0) std::cout << "\n";
+        git_status git;
+        if (auto err = git.load(dirs[i]))
+        {
+            err->message(std::cerr << prog << ": " << dirs[i]
+                                   << ": no git index: ") << "\n";
+            return 1;
+        }
+        printer(show_hidden).print(git.root(dirs[i]), std::cout, depth);
+    }
+    return 0;
+}
+
+int tui_browse(const char* prog, int ndirs, char** dirs, bool show_hidden)
+{
+    raw_terminal term;
+    if (!term)
+    {
+        std::cerr << prog << ": --tui needs a terminal\n";
+        return 1;
+    }
+
+    tui browser(show_hidden);
+    if (ndirs == 0)
+        browser.add_root(".");
+    for (int i = 0; i < ndirs; ++i)
+        browser.add_root(dirs[i]);
+    browser.run();
+    return 0;
+}
+
+int html_export(const char* prog, int ndirs, char** dirs,
+                bool show_hidden, int depth)
+{
+    html_writer writer(show_hidden, depth == -1 ? -1 : depth - 1);
+    if (ndirs == 0)
+        writer.add_root(".");
+    for (int i = 0; i < ndirs; ++i)
+        writer.add_root(dirs[i]);
+
+    if (!writer.finish())
+    {
+        writer.error()->message(std::cerr << prog << ": ") << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int table_export(const char* prog, char sep, std::string_view columns,
+                 int ndirs, char** dirs, bool show_hidden, int depth)
+{
+    auto cols = parse_columns(columns);
+    if (!cols)
+    {
+        fprintf(stderr, "%s: invalid column list '%.*s'\n", prog,
+                int(columns.size()), columns.data());
+        return usage(prog), 1;
+    }
+
+    // -d counts levels below the root, as for the tree.
+    table_writer writer(std::move(*cols), sep, show_hidden,
+                        depth == -1 ? -1 : depth - 1);
+    if (ndirs == 0)
+        writer.add_root(".");
+    for (int i = 0; i < ndirs; ++i)
+        writer.add_root(dirs[i]);
+
+    if (!writer.flush())
+    {
+        writer.error()->message(std::cerr << prog << ": ") << "\n";
+        return 1;
+    }
+    writer.walk_errors().print(std::cerr);
+    return writer.walk_errors().empty() ? 0 : 1;
+}
+
+int arrow_export(const char* prog, const char* file,
+                 int ndirs, char** dirs, bool show_hidden)
+{
+    arrow_writer writer(show_hidden);
+    auto err = writer.open(file);
+    if (!err)
+    {
+        if (ndirs == 0)
+            writer.add_root(".");
+        for (int i = 0; i < ndirs; ++i)
+            writer.add_root(dirs[i]);
+        err = writer.close();
+    }
+    if (err)
+    {
+        err->message(std::cerr << prog << ": " << file << ": ") << "\n";
+        return 1;
+    }
+    writer.walk_errors().print(std::cerr);
+    return writer.walk_errors().empty() ? 0 : 1;
+}
+
+int index_build(const char* prog, const char* file, const char* base_file,
+                uint32_t shard, uint32_t shards, int ndirs, char** dirs,
+                bool show_hidden)
+{
+    index_builder builder(show_hidden);
+    builder.set_shard(shard, shards);
+
+    index_chain base;
+    if (base_file)
+    {
+        if (auto err = base.open(base_file))
+        {
+            err->message(std::cerr << prog << ": " << base.at << ": ") << "\n";
+            return 1;
+        }
+
+        // The delta names its base relative to its own directory when they
+        // share one, so the pair can be moved together.
+        char real_base[PATH_MAX], real_dir[PATH_MAX];
+        std::string dir = file;
+        dir.resize(dir.rfind('/') == dir.npos ? 0 : dir.rfind('/') + 1);
+        if (!::realpath(base_file, real_base)
+            || !::realpath(dir.empty() ? "." : dir.c_str(), real_dir))
+        {
+            err_t::last(op_t::open).message(
+                std::cerr << prog << ": " << base_file << ": ") << "\n";
+            return 1;
+        }
+        std::string_view stored = real_base;
+        if (stored.rfind('/') == std::strlen(real_dir)
+            && stored.starts_with(real_dir))
+            stored.remove_prefix(stored.rfind('/') + 1);
+
+        struct stat a, b;
+        if (::stat(file, &a) == 0 && ::stat(base_file, &b) == 0
+            && a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+        {
+            fprintf(stderr, "%s: %s: a delta cannot replace its base\n",
+                    prog, file);
+            return 1;
+        }
+        builder.set_base(base, std::string(stored));
+    }
+
+    if (ndirs == 0)
+        builder.add_root(".");
+    for (int i = 0; i < ndirs; ++i)
+        builder.add_root(dirs[i]);
+
+    if (auto err = builder.write(file))
+    {
+        err->message(std::cerr << prog << ": " << file << ": ") << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int index_merge(const char* prog, const char* file, int nparts, char** parts)
+{
+    index_builder builder(false);
+    bool hidden = false;
+    for (int i = 0; i < nparts; ++i)
+    {
+        index_chain part;
+        auto err = part.open(parts[i]);
+        if (!err && i == 0)
+            hidden = part.top().flags() & index_hidden;
+        else if (!err && bool(part.top().flags() & index_hidden) != hidden)
+        {
+            fprintf(stderr, "%s: %s: built %s -a, unlike %s\n", prog,
+                    parts[i], hidden ? "without" : "with", parts[0]);
+            return 1;
+        }
+        if (!err) err = builder.merge(part);
+        if (err)
+        {
+            err->message(std::cerr << prog << ": " << part.at << ": ") << "\n";
+            return 1;
+        }
+    }
+
+    if (auto err = builder.write(file))
+    {
+        err->message(std::cerr << prog << ": " << file << ": ") << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int index_query(const char* prog, const char* file, std::string_view pattern,
+                int depth)
+{
+    index_chain chain;
+    if (auto err = chain.open(file))
+    {
+        err->message(std::cerr << prog << ": " << chain.at << ": ") << "\n";
+        return 1;
+    }
+
+    index_view view(chain, chain.query(pattern));
+    bool first = true;
+    for (const auto& root : view.roots())
+    {
+        if (!std::exchange(first, false)) std::cout << "\n";
+        printer(true).print(root, std::cout, depth);
+    }
+    return 0;
+}
+
+// Moves the process to the idle I/O class and the lowest CPU priority, so
+// that a background walk yields to everything else.
+void set_idle(const char* prog)
+{
+    constexpr int ioprio_who_process = 1;
+    constexpr int ioprio_class_idle = 3;
+    constexpr int ioprio_class_shift = 13;
+    if (::syscall(SYS_ioprio_set, ioprio_who_process, 0,
+                  ioprio_class_idle << ioprio_class_shift) == -1)
+        std::cerr << prog << ": ioprio_set: " << std::strerror(errno) << "\n";
+    if (::setpriority(PRIO_PROCESS, 0, 19) == -1)
+        std::cerr << prog << ": setpriority: " << std::strerror(errno) << "\n";
+}
+
+int main(int argc, char** argv)
+{
+    const char* prog = argv[0];
+    int depth = -1;
+    bool show_hidden = false;
+    bool show_links = false;
+    bool errors_only = false;
+    bool show_collisions = false;
+    std::string_view index_mode;
+    const char* index_base = nullptr;
+    uint32_t shard = 0, shards = 1;
+    const char* arrow_file = nullptr;
+    char table_sep = 0;
+    bool html = false;
+    bool browse = false;
+    double estimate = 0;
+    bool by_owner = false;
+    bool allocation = false;
+    std::optional<uint64_t> fragmentation;
+    bool collisions = false;
+    bool git = false;
+    bool use_uring = false;
+    std::string_view columns = "path,depth,type,size,mtime,mode";
+    const char* serve_socket = nullptr;
+    const char* client_socket = nullptr;
+
+    auto show = [&](const auto path)
+    {
+        auto f = file_t(make_ref<fd_t>(AT_FDCWD), path);
+        printer(show_hidden, show_links, errors_only, show_collisions)
+            .print(f, std::cout, depth);
+    };
+
+    OutputTerminal = bool(isatty(1));
+
+    // Printed as main returns, whichever mode ran.
+    struct stats_report
+    {
+        bool on = false;
+
+        ~stats_report()
+        {
+            if (!on) return;
+            ::rusage ru;
+            ::getrusage(RUSAGE_SELF, &ru);
+            std::cerr << "peak rss: " << ru.ru_maxrss << " KiB\n"
+                      << "peak accounted: " << Memory.peak() / 1024 << " KiB";
+            if (Memory.limit() != SIZE_MAX)
+                std::cerr << " of " << Memory.limit() / 1024 << " KiB, "
+                          << Memory.refused() << " requests refused";
+            std::cerr << "\n";
+        }
+    } stats;
+
+    enum { opt_index = 256, opt_base, opt_shard, opt_max_iops,
+           opt_max_dirs, opt_idle, opt_deadline, opt_max_memory, opt_stats,
+           opt_arrow, opt_html, opt_tui,
+           opt_estimate, opt_by_owner, opt_allocation,
+           opt_fragmentation, opt_collisions, opt_git, opt_uring,
+           opt_csv, opt_tsv,
+           opt_columns, opt_serve, opt_client };
+    const char* optstr = "hd:aHEC";
+    const ::option longopts[] = {
+        { "help",      no_argument,       nullptr, 'h' },
+        { "hardlinks", no_argument,       nullptr, 'H' },
+        { "errors-only", no_argument,     nullptr, 'E' },
+        { "tag-collisions", no_argument,  nullptr, 'C' },
+        { "index",     required_argument, nullptr, opt_index },
+        { "base",      required_argument, nullptr, opt_base },
+        { "shard",     required_argument, nullptr, opt_shard },
+        { "max-iops",  required_argument, nullptr, opt_max_iops },
+        { "max-dirs-per-sec", required_argument, nullptr, opt_max_dirs },
+        { "idle",      no_argument,       nullptr, opt_idle },
+        { "deadline",  required_argument, nullptr, opt_deadline },
+        { "max-memory", required_argument, nullptr, opt_max_memory },
+        { "stats",     no_argument,       nullptr, opt_stats },
+        { "arrow",     required_argument, nullptr, opt_arrow },
+        { "html",      no_argument,       nullptr, opt_html },
+        { "tui",       no_argument,       nullptr, opt_tui },
+        { "estimate",  optional_argument, nullptr, opt_estimate },
+        { "by-owner",  no_argument,       nullptr, opt_by_owner },
+        { "allocation", no_argument,      nullptr, opt_allocation },
+        { "fragmentation", optional_argument, nullptr, opt_fragmentation },
+        { "collisions", no_argument,      nullptr, opt_collisions },
+        { "git",       no_argument,       nullptr, opt_git },
+        { "uring",     no_argument,       nullptr, opt_uring },
+        { "csv",       no_argument,       nullptr, opt_csv },
+        { "tsv",       no_argument,       nullptr, opt_tsv },
+        { "columns",   required_argument, nullptr, opt_columns },
+        { "serve",     required_argument, nullptr, opt_serve },
+        { "client",    required_argument, nullptr, opt_client },
+        { nullptr,     0,                 nullptr, 0 },
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, optstr, longopts, nullptr)) != -1)
+    {
+        switch (c)
+        {
+            case 'h': return usage(prog), 0;
+            case 'd':
+            {
+                auto end = optarg + std::strlen(optarg);
+                auto [ptr, ec] = std::from_chars(optarg, end, depth);
+                if (ec != std::errc() || ptr != end || depth < 0)
+                {
+                    fprintf(stderr, "%s: invalid depth '%s'\n",
+                            prog, optarg);
+                    return usage(prog), 1;
+                }
+                break;
+            }
+            case 'a': show_hidden = true; break;
+            case 'H': show_links = true; break;
+            case 'E': errors_only = true; break;
+            case 'C': show_collisions = true; break;
+            case opt_index: index_mode = optarg; break;
+            case opt_base: index_base = optarg; break;
+            case opt_shard:
+            {
+                auto end = optarg + std::strlen(optarg);
+                auto [slash, ec] = std::from_chars(optarg, end, shard);
+                if (ec == std::errc() && slash != end && *slash == '/')
+                {
+                    auto [ptr, ec2] = std::from_chars(slash + 1, end, shards);
+                    if (ec2 == std::errc() && ptr == end
+                        && 1 <= shard && shard <= shards)
+                    {
+                        --shard;
+                        break;
+                    }
+                }
+                fprintf(stderr, "%s: invalid shard '%s'\n", prog, optarg);
+                return usage(prog), 1;
+            }
+            case opt_arrow: arrow_file = optarg; break;
+            case opt_html: html = true; break;
+            case opt_tui: browse = true; break;
+            case opt_by_owner: by_owner = true; break;
+            case opt_allocation: allocation = true; break;
+            case opt_collisions: collisions = true; break;
+            case opt_git: git = true; break;
+            case opt_uring: use_uring = true; break;
+            case opt_fragmentation:
+            {
+                fragmentation = 1024 * 1024;
+                if (!optarg) break;
+                auto end = optarg + std::strlen(optarg);
+                auto [ptr, ec] = std::from_chars(optarg, end, *fragmentation);
+                if (ec != std::errc() || ptr != end)
+                {
+                    fprintf(stderr, "%s: invalid size '%s'\n", prog, optarg);
+                    return usage(prog), 1;
+                }
+                break;
+            }
+            case opt_estimate:
+            {
+                estimate = 5;
+                if (!optarg) break;
+                auto end = optarg + std::strlen(optarg);
+                auto [ptr, ec] = std::from_chars(optarg, end, estimate);
+                if (ec != std::errc() || ptr != end || !(estimate > 0))
+                {
+                    fprintf(stderr, "%s: invalid time '%s'\n", prog, optarg);
+                    return usage(prog), 1;
+                }
+                break;
+            }
+            case opt_max_iops:
+            case opt_max_dirs:
+            {
+                double rate = 0;
+                auto end = optarg + std::strlen(optarg);
+                auto [ptr, ec] = std::from_chars(optarg, end, rate);
+                if (ec != std::errc() || ptr != end || !(rate > 0))
+                {
+                    fprintf(stderr, "%s: invalid rate '%s'\n", prog, optarg);
+                    return usage(prog), 1;
+                }
+                (c == opt_max_iops ? IopsLimit : DirsLimit).set_rate(rate);
+                break;
+            }
+            case opt_idle: set_idle(prog); break;
+            case opt_stats: stats.on = true; break;
+            case opt_max_memory:
+            {
+                size_t n = 0;
+                auto end = optarg + std::strlen(optarg);
+                auto [ptr, ec] = std::from_chars(optarg, end, n);
+                int shift = ptr == end ? 0 : std::string_view("KMG").find(*ptr);
+                if (ec != std::errc() || shift == -1
+                    || ptr + (ptr != end) != end || n == 0)
+                {
+                    fprintf(stderr, "%s: invalid size '%s'\n", prog, optarg);
+                    return usage(prog), 1;
+                }
+                if (ptr != end) shift = (shift + 1) * 10;
+                if (n > SIZE_MAX >> shift)
+                {
+                    fprintf(stderr, "%s: size too large '%s'\n", prog, optarg);
+                    return usage(prog), 1;
+                }
+                Memory.set_limit(n << shift);
+                break;
+            }
+            case opt_deadline:
+            {
+                unsigned ms = 0;
+                auto end = optarg + std::strlen(optarg);
+                auto [ptr, ec] = std::from_chars(optarg, end, ms);
+                if (ec != std::errc() || ptr != end || ms == 0)
+                {
+                    fprintf(stderr, "%s: invalid deadline '%s'\n", prog, optarg);
+                    return usage(prog), 1;
+                }
+                OpDeadline = std::chrono::milliseconds(ms);
+                break;
+            }
+            case opt_csv: table_sep = ','; break;
+            case opt_tsv: table_sep = '\t'; break;
+            case opt_columns: columns = optarg; break;
+            case opt_serve: serve_socket = optarg; break;
+            case opt_client: client_socket = optarg; break;
+            default: return usage(prog), 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (depth != -1) ++depth;
+
+    if (index_mode == "build" && argc >= 2)
+        return index_build(prog, argv[1], index_base, shard, shards,
+                           argc - 2, argv + 2, show_hidden);
+    if (index_mode == "merge" && argc >= 3)
+        return index_merge(prog, argv[1], argc - 2, argv + 2);
+    if (index_mode == "query" && argc == 3)
+        return index_query(prog, argv[1], argv[2], depth);
+    if (!index_mode.empty())
+        return usage(prog), 1;
+
+    if (estimate > 0)
+    {
+        for (int i = 1; i < std::max(argc, 2); ++i)
+        {
+            if (i > 1) std::cout << "\n";
+            estimator(show_hidden).run(argc < 2 ? "." : argv[i], estimate,
+                                       std::cout);
+        }
+        return 0;
+    }
+
+    if (by_owner)
+    {
+        owner_report report(show_hidden);
+        if (argc < 2)
+            report.add_root(".");
+        for (int i = 1; i < argc; ++i)
+            report.add_root(argv[i]);
+        report.print(std::cout);
+        return report.failed() ? 1 : 0;
+    }
+
+    if (allocation)
+    {
+        allocation_report report(show_hidden);
+        if (argc < 2)
+            report.add_root(".");
+        for (int i = 1; i < argc; ++i)
+            report.add_root(argv[i]);
+        report.print(std::cout);
+        return report.failed() ? 1 : 0;
+    }
+
+    if (fragmentation)
+    {
+        fragmentation_report report(show_hidden, *fragmentation);
+        if (argc < 2)
+            report.add_root(".");
+        for (int i = 1; i < argc; ++i)
+            report.add_root(argv[i]);
+        report.print(std::cout);
+        return report.failed() ? 1 : 0;
+    }
+
+    if (collisions)
+    {
+        collision_finder finder(show_hidden);
+        if (argc < 2)
+            finder.add_root(".", std::cout);
+        for (int i = 1; i < argc; ++i)
+            finder.add_root(argv[i], std::cout);
+        finder.print_errors(std::cout);
+        return finder.found() ? 2 : finder.failed() ? 1 : 0;
+    }
+
+    if (use_uring && (show_links || errors_only || show_collisions
+                      || IopsLimit.limited() || DirsLimit.limited()
+                      || OpDeadline.count()))
+    {
+        fprintf(stderr, "%s: --uring does not support -H, -E, -C, --max-iops,"
+                " --max-dirs-per-sec or --deadline\n", prog);
+        return usage(prog), 1;
+    }
+    if (use_uring)
+        return uring_show(prog, argc - 1, argv + 1, show_hidden, depth);
+
+    if (git)
+        return git_show(prog, argc - 1, argv + 1, show_hidden, depth);
+
+    if (browse)
+        return tui_browse(prog, argc - 1, argv + 1, show_hidden);
+
+    if (html)
+        return html_export(prog, argc - 1, argv + 1, show_hidden, depth);
+
+    if (table_sep)
+        return table_export(prog, table_sep, columns, argc - 1, argv + 1,
+                            show_hidden, depth);
+
+    if (arrow_file)
+        return arrow_export(prog, arrow_file, argc - 1, argv + 1, show_hidden);
+
+    if (serve_socket)
+        return serve(prog, serve_socket, argc - 1, argv + 1);
+    if (client_socket && (argc == 2 || argc == 3))
+        return serve_client(prog, client_socket, argv[1],
+                            argc == 3 ? argv[2] : "", show_hidden, depth);
+    if (client_socket)
+        return usage(prog), 1;
 
     if (argc < 2)
         return show("."), 0;